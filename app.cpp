@@ -20,17 +20,18 @@
  * THE SOFTWARE.
  */
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <cstring>
 
 #include "include/OutputStream.hpp"
-#include "include/InputStream.hpp"
+#include "include/ParallelInputStream.hpp"
 
 int main(int argc, char *argv[])
 {
-    const char *flags = "\n\n  [--help|-h]              print help\n  [--dec|-d]               decompress file\n  [--keep|-k]              keep original (de)compressed file\n  [--check|-c]             check compressed file integrity\n  [--size|-s <1-9>]        set block size 10k .. 90k\n  [--parallel|-p <1+>]     number of parallel threads for gpu\n";
+    const char *flags = "\n\n  [--help|-h]              print help\n  [--dec|-d]               decompress file\n  [--keep|-k]              keep original (de)compressed file\n  [--check|-c]             check compressed file integrity\n  [--size|-s <1-9>]        set block size 10k .. 90k\n  [--parallel|-p <0+>]     number of blocks per batch, 0 = sized from the device and input\n  [--slots|-q <1+>]        number of batches in flight on gpu\n  [--backend|-b <auto|opencl|cpu>] compression backend, auto falls back to cpu without a usable OpenCL device\n  [--threads|-t <0+>]      number of cpu threads for the cpu backend and decompression, 0 = all cores\n  [--verify|-v]            compare gpu output with the host build of the kernel\n  [--timing|-T]            print per-stage compression timings\n  [--device-rle|-r]        run RLE1 and the block CRCs on the gpu, the host only splits the input\n  [--autotune|-A]          measure batch and work-group sizes on the start of the input, save them for the device\n";
     if (argc < 2)
     {
         std::cerr << "\n  Usage: .\\bzip2.exe [file_path] [flags]" << flags << std::endl;
@@ -42,7 +43,14 @@ int main(int argc, char *argv[])
     bool keepFile = false;
     bool checkCRC = false;
     int blockSize = 9;    // Default block size
-    int parallelCnt = 10; // Default parallel blocks
+    int parallelCnt = 0;  // Default blocks per batch from the device
+    int slotCnt = 2;      // Default batches in flight
+    int threadCnt = 0;    // Default all cores for cpu backend
+    bool verifyOnHost = false;
+    bool collectTimings = false;
+    bool rleOnDevice = false;
+    bool autotune = false;
+    CompressionBackend backend = CompressionBackend::Auto;
 
     // Parse command-line arguments
     for (int i = 1; i < argc; ++i)
@@ -63,6 +71,51 @@ int main(int argc, char *argv[])
         {
             parallelCnt = std::atoi(argv[++i]);
         }
+        else if ((std::strcmp(argv[i], "--slots") == 0 || std::strcmp(argv[i], "-q") == 0) && i + 1 < argc)
+        {
+            slotCnt = std::atoi(argv[++i]);
+        }
+        else if ((std::strcmp(argv[i], "--backend") == 0 || std::strcmp(argv[i], "-b") == 0) && i + 1 < argc)
+        {
+            ++i;
+            if (std::strcmp(argv[i], "auto") == 0)
+            {
+                backend = CompressionBackend::Auto;
+            }
+            else if (std::strcmp(argv[i], "opencl") == 0)
+            {
+                backend = CompressionBackend::OpenCL;
+            }
+            else if (std::strcmp(argv[i], "cpu") == 0)
+            {
+                backend = CompressionBackend::CPU;
+            }
+            else
+            {
+                std::cerr << "  Unknown backend!\n\n  Usage: .\\bzip2.exe [file_path] [flags]" << flags << std::endl;
+                return 1;
+            }
+        }
+        else if ((std::strcmp(argv[i], "--threads") == 0 || std::strcmp(argv[i], "-t") == 0) && i + 1 < argc)
+        {
+            threadCnt = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--verify") == 0 || std::strcmp(argv[i], "-v") == 0)
+        {
+            verifyOnHost = true;
+        }
+        else if (std::strcmp(argv[i], "--timing") == 0 || std::strcmp(argv[i], "-T") == 0)
+        {
+            collectTimings = true;
+        }
+        else if (std::strcmp(argv[i], "--device-rle") == 0 || std::strcmp(argv[i], "-r") == 0)
+        {
+            rleOnDevice = true;
+        }
+        else if (std::strcmp(argv[i], "--autotune") == 0 || std::strcmp(argv[i], "-A") == 0)
+        {
+            autotune = true;
+        }
         else if (std::strcmp(argv[i], "--check") == 0 || std::strcmp(argv[i], "-c") == 0)
         {
             checkCRC = true;
@@ -100,7 +153,44 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-        OutputStream bz2out(outputFile, blockSize, parallelCnt);
+        // Caps the automatic batch size, unknown (0) when the input can't seek
+        inputFile.seekg(0, std::ios::end);
+        const std::streamoff inputEnd = inputFile.tellg();
+        const size_t inputLength = inputEnd > 0 ? static_cast<size_t>(inputEnd) : 0;
+        inputFile.clear();
+        if (inputEnd > 0)
+        {
+            inputFile.seekg(0, std::ios::beg);
+        }
+
+        OutputStream bz2out(outputFile, blockSize, parallelCnt, slotCnt, backend, threadCnt, verifyOnHost, collectTimings, rleOnDevice, inputLength);
+
+        if (autotune)
+        {
+            // The start of the input stands for the rest of it. It is read again for
+            // compression when the input can seek and written from the sample otherwise.
+            std::vector<char> sample(32 << 20);
+            inputFile.read(sample.data(), sample.size());
+            sample.resize(static_cast<size_t>(inputFile.gcount()));
+            if (sample.empty())
+            {
+                std::cerr << "Warning: Empty input, autotune skipped" << std::endl;
+            }
+            else
+            {
+                bz2out.autotune(reinterpret_cast<const uint8_t *>(sample.data()), sample.size());
+            }
+
+            if (inputLength > 0)
+            {
+                inputFile.clear();
+                inputFile.seekg(0, std::ios::beg);
+            }
+            else
+            {
+                bz2out.write(reinterpret_cast<const uint8_t *>(sample.data()), sample.size());
+            }
+        }
 
         const size_t bufferSize = 131072;
         std::vector<char> buffer(bufferSize);
@@ -109,10 +199,7 @@ int main(int argc, char *argv[])
         {
             inputFile.read(buffer.data(), bufferSize);
             std::streamsize bytes_read = inputFile.gcount();
-            for (int i = 0; i < bytes_read; ++i)
-            {
-                bz2out.write(buffer[i]);
-            }
+            bz2out.write(reinterpret_cast<const uint8_t *>(buffer.data()), static_cast<size_t>(bytes_read));
         }
         bz2out.close();
 
@@ -146,13 +233,14 @@ int main(int argc, char *argv[])
                 return 1;
             }
 
-            InputStream bz2in(inputFile);
+            ParallelInputStream bz2in(inputFile, threadCnt);
 
-            int ch;
-            while ((ch = bz2in.read()) != -1)
+            const size_t bufferSize = 1 << 20;
+            std::vector<uint8_t> buffer(bufferSize);
+            int bytesRead;
+            while ((bytesRead = bz2in.read(buffer.data(), bufferSize)) != -1)
             {
-                char x = ch;
-                outputFile.write(&x, 1);
+                outputFile.write(reinterpret_cast<const char *>(buffer.data()), bytesRead);
             }
             bz2in.close();
 
@@ -160,8 +248,9 @@ int main(int argc, char *argv[])
         }
         else
         {
-            InputStream bz2in(inputFile);
-            while (bz2in.read() != -1)
+            ParallelInputStream bz2in(inputFile, threadCnt);
+            std::vector<uint8_t> buffer(1 << 20);
+            while (bz2in.read(buffer.data(), buffer.size()) != -1)
                 ;
             bz2in.close();
             std::cout << "  Integrity check passed!" << std::endl;
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2024 Stanislav Brega
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "include/OutputStream.hpp"
+#include "include/ParallelInputStream.hpp"
+#include "include/BenchInput.hpp"
+
+// bzip2-bench: in-memory compression and decompression over a sweep of
+// block sizes and parallel block counts, results as CSV or JSON
+
+struct BenchResult
+{
+    int blockSize;
+    int parallelCnt;
+    size_t inputBytes;
+    size_t compressedBytes;
+    double compressSeconds;
+    double decompressSeconds;
+    size_t peakRSS;
+    bool roundTripOk;
+};
+
+// Peak resident set size of the process so far, in bytes
+size_t peakRSS()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize;
+#elif defined(__APPLE__)
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<size_t>(usage.ru_maxrss); // bytes on macOS
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<size_t>(usage.ru_maxrss) * 1024UL; // kilobytes on Linux
+#endif
+}
+
+BenchResult runOnce(const std::vector<char> &input, int blockSize, int parallelCnt, int slotCnt, CompressionBackend backend, int threadCnt, bool verifyOnHost)
+{
+    BenchResult result{blockSize, parallelCnt, input.size(), 0UL, 0.0, 0.0, 0UL, false};
+
+    std::ostringstream compressed(std::ios::binary);
+    {
+        // Device setup and program build are not part of the timing
+        OutputStream bz2out(compressed, blockSize, parallelCnt, slotCnt, backend, threadCnt, verifyOnHost);
+
+        Clock clock;
+        bz2out.write(reinterpret_cast<const uint8_t *>(input.data()), input.size());
+        bz2out.close();
+        result.compressSeconds = clock.stop();
+    }
+
+    const std::string compressedData = compressed.str();
+    result.compressedBytes = compressedData.size();
+
+    std::istringstream compressedIn(compressedData, std::ios::binary);
+    std::vector<uint8_t> buffer(1 << 20);
+    std::vector<char> output;
+    output.reserve(input.size());
+
+    Clock clock;
+    ParallelInputStream bz2in(compressedIn, threadCnt);
+    int bytesRead;
+    while ((bytesRead = bz2in.read(buffer.data(), buffer.size())) != -1)
+    {
+        output.insert(output.end(), buffer.begin(), buffer.begin() + bytesRead);
+    }
+    bz2in.close();
+    result.decompressSeconds = clock.stop();
+
+    result.roundTripOk = output == input;
+    result.peakRSS = peakRSS();
+    return result;
+}
+
+double megabytesPerSecond(size_t bytes, double seconds)
+{
+    return seconds > 0.0 ? bytes / 1e6 / seconds : 0.0;
+}
+
+void writeCSV(std::ostream &out, const std::vector<BenchResult> &results)
+{
+    out << "size,parallel,input_bytes,compressed_bytes,ratio,compress_mb_s,decompress_mb_s,peak_rss_mb,round_trip\n";
+    for (const BenchResult &r : results)
+    {
+        out << r.blockSize << ',' << r.parallelCnt << ',' << r.inputBytes << ',' << r.compressedBytes << ','
+            << (r.compressedBytes ? static_cast<double>(r.inputBytes) / r.compressedBytes : 0.0) << ','
+            << megabytesPerSecond(r.inputBytes, r.compressSeconds) << ','
+            << megabytesPerSecond(r.inputBytes, r.decompressSeconds) << ','
+            << r.peakRSS / 1048576.0 << ',' << (r.roundTripOk ? "ok" : "FAIL") << '\n';
+    }
+}
+
+void writeJSON(std::ostream &out, const std::vector<BenchResult> &results)
+{
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult &r = results[i];
+        out << "  {\"size\": " << r.blockSize << ", \"parallel\": " << r.parallelCnt
+            << ", \"input_bytes\": " << r.inputBytes << ", \"compressed_bytes\": " << r.compressedBytes
+            << ", \"ratio\": " << (r.compressedBytes ? static_cast<double>(r.inputBytes) / r.compressedBytes : 0.0)
+            << ", \"compress_mb_s\": " << megabytesPerSecond(r.inputBytes, r.compressSeconds)
+            << ", \"decompress_mb_s\": " << megabytesPerSecond(r.inputBytes, r.decompressSeconds)
+            << ", \"peak_rss_mb\": " << r.peakRSS / 1048576.0
+            << ", \"round_trip\": " << (r.roundTripOk ? "true" : "false") << "}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]\n";
+}
+
+int main(int argc, char *argv[])
+{
+    const char *flags = "\n\n  [--help|-h]              print help\n  [--size|-s <list>]       block sizes to sweep, e.g. 1-9 or 1,5,9 (default 1-9)\n  [--parallel|-p <list>]   parallel block counts to sweep (default 1,2,4,8,16,32)\n  [--slots|-q <1+>]        number of batches in flight\n  [--backend|-b <auto|opencl|cpu>] compression backend\n  [--threads|-t <0+>]      number of cpu threads for the cpu backend and decompression, 0 = all cores\n  [--verify|-v]            compare gpu output with the host build of the kernel, fails on the first difference\n  [--repeat|-r <1+>]       runs per setting, the fastest is reported\n  [--synthetic|-m <MB>]    size of generated input when no file is given (default 16)\n  [--log|-l]               generate near-periodic log lines instead of text\n  [--format|-f <csv|json>] result format (default csv)\n  [--output|-o <file>]     write results to file instead of stdout\n";
+
+    std::string filename;
+    std::string outputFilename;
+    std::vector<int> blockSizes = parseList("1-9");
+    std::vector<int> parallelCnts = parseList("1,2,4,8,16,32");
+    int slotCnt = 2;
+    int threadCnt = 0;
+    bool verifyOnHost = false;
+    int repeatCnt = 1;
+    size_t syntheticMB = 16;
+    bool logInput = false;
+    bool json = false;
+    CompressionBackend backend = CompressionBackend::Auto;
+
+    // Parse command-line arguments
+    for (int i = 1; i < argc; ++i)
+    {
+        if ((std::strcmp(argv[i], "--size") == 0 || std::strcmp(argv[i], "-s") == 0) && i + 1 < argc)
+        {
+            blockSizes = parseList(argv[++i]);
+        }
+        else if ((std::strcmp(argv[i], "--parallel") == 0 || std::strcmp(argv[i], "-p") == 0) && i + 1 < argc)
+        {
+            parallelCnts = parseList(argv[++i]);
+        }
+        else if ((std::strcmp(argv[i], "--slots") == 0 || std::strcmp(argv[i], "-q") == 0) && i + 1 < argc)
+        {
+            slotCnt = std::atoi(argv[++i]);
+        }
+        else if ((std::strcmp(argv[i], "--backend") == 0 || std::strcmp(argv[i], "-b") == 0) && i + 1 < argc)
+        {
+            ++i;
+            if (std::strcmp(argv[i], "auto") == 0)
+            {
+                backend = CompressionBackend::Auto;
+            }
+            else if (std::strcmp(argv[i], "opencl") == 0)
+            {
+                backend = CompressionBackend::OpenCL;
+            }
+            else if (std::strcmp(argv[i], "cpu") == 0)
+            {
+                backend = CompressionBackend::CPU;
+            }
+            else
+            {
+                std::cerr << "  Unknown backend!\n\n  Usage: .\\bzip2-bench.exe [file_path] [flags]" << flags << std::endl;
+                return 1;
+            }
+        }
+        else if ((std::strcmp(argv[i], "--threads") == 0 || std::strcmp(argv[i], "-t") == 0) && i + 1 < argc)
+        {
+            threadCnt = std::atoi(argv[++i]);
+        }
+        else if (std::strcmp(argv[i], "--verify") == 0 || std::strcmp(argv[i], "-v") == 0)
+        {
+            verifyOnHost = true;
+        }
+        else if ((std::strcmp(argv[i], "--repeat") == 0 || std::strcmp(argv[i], "-r") == 0) && i + 1 < argc)
+        {
+            repeatCnt = std::max(1, std::atoi(argv[++i]));
+        }
+        else if ((std::strcmp(argv[i], "--synthetic") == 0 || std::strcmp(argv[i], "-m") == 0) && i + 1 < argc)
+        {
+            syntheticMB = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (std::strcmp(argv[i], "--log") == 0 || std::strcmp(argv[i], "-l") == 0)
+        {
+            logInput = true;
+        }
+        else if ((std::strcmp(argv[i], "--format") == 0 || std::strcmp(argv[i], "-f") == 0) && i + 1 < argc)
+        {
+            json = std::strcmp(argv[++i], "json") == 0;
+        }
+        else if ((std::strcmp(argv[i], "--output") == 0 || std::strcmp(argv[i], "-o") == 0) && i + 1 < argc)
+        {
+            outputFilename = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--help") == 0 || std::strcmp(argv[i], "-h") == 0)
+        {
+            std::cout << "\n  Usage: .\\bzip2-bench.exe [file_path] [flags]" << flags << std::endl;
+            return 0;
+        }
+        else if (argv[i][0] == '-')
+        {
+            std::cerr << "  Unknown flag!\n\n  Usage: .\\bzip2-bench.exe [file_path] [flags]" << flags << std::endl;
+            return 1;
+        }
+        else
+        {
+            filename = argv[i];
+        }
+    }
+
+    std::vector<char> input;
+    if (!filename.empty())
+    {
+        std::ifstream inputFile(filename, std::ios::binary);
+        if (!inputFile.is_open())
+        {
+            std::cerr << "Failed to open input file." << std::endl;
+            return 1;
+        }
+        input.assign(std::istreambuf_iterator<char>(inputFile), std::istreambuf_iterator<char>());
+    }
+    else
+    {
+        input = logInput ? syntheticLogInput(syntheticMB * 1000000UL) : syntheticInput(syntheticMB * 1000000UL);
+    }
+
+    std::vector<BenchResult> results;
+    for (int blockSize : blockSizes)
+    {
+        for (int parallelCnt : parallelCnts)
+        {
+            BenchResult best = runOnce(input, blockSize, parallelCnt, slotCnt, backend, threadCnt, verifyOnHost);
+            for (int i = 1; i < repeatCnt; ++i)
+            {
+                BenchResult next = runOnce(input, blockSize, parallelCnt, slotCnt, backend, threadCnt, verifyOnHost);
+                best.compressSeconds = std::min(best.compressSeconds, next.compressSeconds);
+                best.decompressSeconds = std::min(best.decompressSeconds, next.decompressSeconds);
+                best.peakRSS = next.peakRSS;
+                best.roundTripOk = best.roundTripOk && next.roundTripOk;
+            }
+            results.push_back(best);
+        }
+    }
+
+    std::ofstream outputFile;
+    if (!outputFilename.empty())
+    {
+        outputFile.open(outputFilename);
+        if (!outputFile.is_open())
+        {
+            std::cerr << "Failed to open output file." << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &out = outputFilename.empty() ? std::cout : outputFile;
+    if (json)
+    {
+        writeJSON(out, results);
+    }
+    else
+    {
+        writeCSV(out, results);
+    }
+
+    for (const BenchResult &r : results)
+    {
+        if (!r.roundTripOk)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2024 Stanislav Brega
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef BENCH_INPUT_HPP
+#define BENCH_INPUT_HPP
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+
+// Inputs and argument parsing shared by bzip2-bench and bzip2-microbench
+
+// Text-like data from a small vocabulary with some runs, same for every run
+inline std::vector<char> syntheticInput(size_t length)
+{
+    static const char *words[] = {"the ", "block ", "sort ", "compression ", "of ", "data ", "and ", "huffman ",
+                                  "move ", "to ", "front ", "wheeler ", "burrows ", "parallel ", "device ", "\n"};
+    std::vector<char> data;
+    data.reserve(length);
+
+    uint32_t state = 12345U;
+    while (data.size() < length)
+    {
+        state = state * 1103515245U + 12345U;
+        if ((state >> 16) % 64 == 0)
+        {
+            data.insert(data.end(), (state >> 8) % 200, static_cast<char>('a' + (state >> 24) % 26));
+        }
+        else
+        {
+            const char *word = words[(state >> 16) % 16];
+            data.insert(data.end(), word, word + std::strlen(word));
+        }
+    }
+    data.resize(length);
+    return data;
+}
+
+// Log lines that repeat every thousand lines, so most blocks are close to a
+// repetition of one period without being one
+inline std::vector<char> syntheticLogInput(size_t length)
+{
+    std::vector<char> data;
+    data.reserve(length);
+    for (int line = 0; data.size() < length; ++line)
+    {
+        const std::string text = "line " + std::to_string(line % 1000) + " of some log file with repeated content aaaaaaaa\n";
+        data.insert(data.end(), text.begin(), text.end());
+    }
+    data.resize(length);
+    return data;
+}
+
+// Parses "3" or "1-9" or "1,2,4,8"
+inline std::vector<int> parseList(const char *text)
+{
+    std::vector<int> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        size_t dash = item.find('-');
+        if (dash != std::string::npos && dash > 0)
+        {
+            int first = std::atoi(item.substr(0, dash).c_str());
+            int last = std::atoi(item.substr(dash + 1).c_str());
+            for (int value = first; value <= last; ++value)
+            {
+                values.push_back(value);
+            }
+        }
+        else
+        {
+            values.push_back(std::atoi(item.c_str()));
+        }
+    }
+    return values;
+}
+#endif
@@ -25,33 +25,90 @@
 #define BIT_INPUT_STREAM_HPP
 
 #include <istream>
+#include <vector>
+#include <cstdint>
 #include <stdexcept>
 
+// Reads the input in large chunks and serves bits MSB first from a 64-bit
+// accumulator, callers can look at up to 32 bits at once with peekBits
 class BitInputStream
 {
 private:
-    std::istream &inputStream;
-    int bitBuffer = 0;
+    static constexpr size_t READ_BUFFER_SIZE = 1 << 16;
+
+    std::istream *inputStream = nullptr; // Null when reading from memory
+    std::vector<uint8_t> readBuffer{};
+    const uint8_t *data = nullptr;
+    size_t dataLength = 0;
+    size_t dataPosition = 0;
+    uint64_t bitAccumulator = 0U; // The low bitCount bits are not consumed yet
     int bitCount = 0;
 
+    bool fillData()
+    {
+        if (!inputStream)
+        {
+            return false;
+        }
+        inputStream->read(reinterpret_cast<char *>(readBuffer.data()), READ_BUFFER_SIZE);
+        dataLength = static_cast<size_t>(inputStream->gcount());
+        dataPosition = 0;
+        return dataLength > 0;
+    }
+
+    // Tops the accumulator up to at least 57 bits, less only at the end of the input
+    void refill()
+    {
+        while (bitCount <= 56)
+        {
+            if (dataPosition == dataLength && !fillData())
+            {
+                return;
+            }
+            bitAccumulator = (bitAccumulator << 8) | data[dataPosition++];
+            bitCount += 8;
+        }
+    }
+
 public:
-    explicit BitInputStream(std::istream &inStream) : inputStream(inStream) {}
+    explicit BitInputStream(std::istream &inStream) : inputStream(&inStream), readBuffer(READ_BUFFER_SIZE)
+    {
+        data = readBuffer.data();
+    }
+
+    // Reads a buffer that outlives the stream, without copying it
+    BitInputStream(const uint8_t *bytes, size_t length) : data(bytes), dataLength(length) {}
+
+    BitInputStream(const BitInputStream &) = delete;
+    BitInputStream &operator=(const BitInputStream &) = delete;
 
     bool readBoolean()
     {
-        if (bitCount == 0)
+        return readBits(1) != 0;
+    }
+
+    // Next count bits (up to 32) without consuming them, zero filled past the end of the input
+    unsigned int peekBits(int count)
+    {
+        if (bitCount < count)
         {
-            char byteRead;
-            if (!inputStream.get(byteRead))
+            refill();
+            if (bitCount < count)
             {
-                throw std::runtime_error("Insufficient data");
+                return static_cast<unsigned int>((bitAccumulator & ((1ULL << bitCount) - 1U)) << (count - bitCount));
             }
-            bitBuffer = (bitBuffer << 8) | static_cast<int>(byteRead);
-            bitCount = 8;
         }
+        return static_cast<unsigned int>((bitAccumulator >> (bitCount - count)) & ((1ULL << count) - 1U));
+    }
 
-        --bitCount;
-        return (bitBuffer & (1 << bitCount)) != 0;
+    // Drops bits seen by peekBits
+    void consumeBits(int count)
+    {
+        if (count > bitCount)
+        {
+            throw std::runtime_error("Insufficient data");
+        }
+        bitCount -= count;
     }
 
     int readUnary()
@@ -66,21 +123,21 @@ public:
 
     int readBits(int count)
     {
-        int bits = 0;
-        for (int i = 0; i < count; ++i)
+        if (bitCount < count)
         {
-            bits <<= 1;
-            if (readBoolean())
+            refill();
+            if (bitCount < count)
             {
-                bits |= 1;
+                throw std::runtime_error("Insufficient data");
             }
         }
-        return bits;
+        bitCount -= count;
+        return static_cast<int>((bitAccumulator >> bitCount) & ((1ULL << count) - 1U));
     }
 
     int readInteger()
     {
-        return (readBits(16) << 16) | readBits(16);
+        return readBits(32);
     }
 };
-#endif
\ No newline at end of file
+#endif
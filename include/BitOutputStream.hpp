@@ -26,111 +26,146 @@
 #include <ostream>
 #include <bitset>
 #include <stdexcept>
-
-std::vector<bool> getLeftBuffer(bool *bitBuffer, size_t *bitCount)
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Joins bit strings that start at arbitrary bit offsets into one staged byte
+// buffer. Whole bytes go to the output in a single write per flush, the last
+// partial byte is kept for the next append.
+class BitStitcher
 {
-    if (*bitCount >= 8U)
+private:
+    std::vector<unsigned char> buffer{};
+    size_t bitCount = 0UL;
+
+    static uint64_t loadBigEndian(const unsigned char *bytes)
     {
-        throw std::runtime_error("Couldn't write all bytes properly during last step.");
+        uint64_t word = 0U;
+        for (int i = 0; i < 8; ++i)
+        {
+            word = (word << 8) | bytes[i];
+        }
+        return word;
     }
 
-    std::vector<bool> leftBuffer(*bitCount);
-    for (int i = 0; i < *bitCount; ++i)
+    static void storeBigEndian(unsigned char *bytes, uint64_t word)
     {
-        leftBuffer[i] = bitBuffer[i];
+        for (int i = 7; i >= 0; --i)
+        {
+            bytes[i] = static_cast<unsigned char>(word);
+            word >>= 8;
+        }
     }
-    *bitCount = 0UL;
 
-    return leftBuffer;
-}
+public:
+    // Appends the first bits of bytes, MSB first
+    void append(const unsigned char *bytes, size_t bits)
+    {
+        if (bits == 0UL)
+        {
+            return;
+        }
 
-void writeFileBytes(bool *bitBuffer, size_t *bitCount, std::ostream &out, const std::vector<bool> &leftBuffer)
-{
-    size_t bitsLeft = leftBuffer.size();
+        const size_t byteCnt = (bits + 7UL) / 8UL;
+        if (buffer.size() < bitCount / 8UL + byteCnt + 1UL)
+        {
+            buffer.resize(std::max(buffer.size() * 2UL, bitCount / 8UL + byteCnt + 1UL));
+        }
 
-    // leftover and current doesn't make a byte
-    if (bitsLeft + *bitCount < 8UL)
-    {
-        if (*bitCount)
+        unsigned char *out = buffer.data() + bitCount / 8UL;
+        const unsigned int shift = bitCount % 8UL;
+        if (shift == 0U)
         {
-            for (int i = *bitCount - 1; i >= 0; --i)
+            std::memcpy(out, bytes, byteCnt);
+        }
+        else
+        {
+            // out[i + 1] takes the low bits of bytes[i] and the high bits of bytes[i + 1]
+            out[0] = static_cast<unsigned char>((out[0] & (0xff00U >> shift)) | (bytes[0] >> shift));
+            size_t i = 0UL;
+            for (; i + 8UL < byteCnt; i += 8UL)
+            {
+                storeBigEndian(out + i + 1UL, (loadBigEndian(bytes + i) << (8U - shift)) | (bytes[i + 8UL] >> shift));
+            }
+            for (; i + 1UL < byteCnt; ++i)
             {
-                bitBuffer[i + bitsLeft] = bitBuffer[i];
+                out[i + 1UL] = static_cast<unsigned char>((bytes[i] << (8U - shift)) | (bytes[i + 1UL] >> shift));
             }
+            out[byteCnt] = static_cast<unsigned char>(bytes[byteCnt - 1UL] << (8U - shift));
         }
 
-        for (size_t i = 0UL; i < bitsLeft; ++i)
+        bitCount += bits;
+        if (bitCount % 8UL != 0UL)
         {
-            bitBuffer[i] = leftBuffer[i];
+            // Clear whatever followed the appended bits in their last byte
+            buffer[bitCount / 8UL] &= static_cast<unsigned char>(0xff00U >> (bitCount % 8UL));
         }
-        *bitCount += bitsLeft;
-        return;
-    }
-
-    unsigned char byte = 0U;
-    for (bool leftBit : leftBuffer)
-    {
-        byte = (byte << 1) | leftBit;
-    }
-    size_t offset = 8UL - bitsLeft;
-    for (size_t i = 0UL; i < offset; ++i)
-    {
-        byte = (byte << 1) | bitBuffer[i];
     }
-    out.put(byte);
 
-    *bitCount -= offset;
-    for (size_t i = 0UL; i < *bitCount / 8UL; ++i)
+    // Writes out all whole bytes, the partial last byte stays staged
+    void flush(std::ostream &out)
     {
-        byte = 0U;
-        for (int j = 0; j < 8; ++j)
+        const size_t byteCnt = bitCount / 8UL;
+        out.write(reinterpret_cast<const char *>(buffer.data()), byteCnt);
+        if (bitCount % 8UL != 0UL)
         {
-            byte = (byte << 1) | bitBuffer[i * 8UL + j + offset];
+            buffer[0] = buffer[byteCnt];
         }
-        out.put(byte);
+        bitCount %= 8UL;
     }
 
-    // Shift left-over bits
-    for (size_t i = 0UL; i < (*bitCount % 8UL); ++i)
+    // Writes out everything, the last byte zero padded
+    void finish(std::ostream &out)
     {
-        bitBuffer[i] = bitBuffer[i + *bitCount - (*bitCount % 8) + offset];
+        bitCount = (bitCount + 7UL) & ~7UL;
+        flush(out);
     }
-    *bitCount %= 8UL;
-}
+};
+
+// Bits are packed MSB first, bitCount counts bits from the start of byteBuffer
 
-void writeBoolean(bool *bitBuffer, size_t *bitCount, bool value)
+void writeBoolean(unsigned char *byteBuffer, size_t *bitCount, bool value)
 {
-    bitBuffer[(*bitCount)++] = value;
+    unsigned char &byte = byteBuffer[*bitCount / 8UL];
+    size_t shift = 7UL - (*bitCount % 8UL);
+    if (shift == 7UL)
+    {
+        byte = 0U;
+    }
+    byte |= static_cast<unsigned char>(value) << shift;
+    ++(*bitCount);
 }
 
-void writeUnary(bool *bitBuffer, size_t *bitCount, int value)
+void writeUnary(unsigned char *byteBuffer, size_t *bitCount, int value)
 {
     while (value-- > 0)
     {
-        writeBoolean(bitBuffer, bitCount, true);
+        writeBoolean(byteBuffer, bitCount, true);
     }
-    writeBoolean(bitBuffer, bitCount, false);
+    writeBoolean(byteBuffer, bitCount, false);
 }
 
-void writeBits(bool *bitBuffer, size_t *bitCount, int count, int value)
+void writeBits(unsigned char *byteBuffer, size_t *bitCount, int count, int value)
 {
     for (int bitMask = (1 << (count - 1)); bitMask; bitMask >>= 1)
     {
-        writeBoolean(bitBuffer, bitCount, bitMask & value);
+        writeBoolean(byteBuffer, bitCount, bitMask & value);
     }
 }
 
-void writeInteger(bool *bitBuffer, size_t *bitCount, int value)
+void writeInteger(unsigned char *byteBuffer, size_t *bitCount, int value)
 {
-    writeBits(bitBuffer, bitCount, 16, (value >> 16) & 0xffff);
-    writeBits(bitBuffer, bitCount, 16, value & 0xffff);
+    writeBits(byteBuffer, bitCount, 16, (value >> 16) & 0xffff);
+    writeBits(byteBuffer, bitCount, 16, value & 0xffff);
 }
 
-void padding(bool *bitBuffer, size_t *bitCount)
+void padding(unsigned char *byteBuffer, size_t *bitCount)
 {
     if (*bitCount % 8UL != 0UL)
     {
-        writeBits(bitBuffer, bitCount, 8 - (*bitCount % 8UL), 0);
+        writeBits(byteBuffer, bitCount, 8 - (*bitCount % 8UL), 0);
     }
 }
 #endif
\ No newline at end of file
@@ -27,6 +27,7 @@
 #include <vector>
 #include <array>
 #include <cstdint>
+#include <cstring>
 #include <algorithm>
 
 #include "Config.hpp"
@@ -39,7 +40,8 @@ private:
     int blockLength = 0;
     int blockLengthLimit;
     bool *blockValuesPresent;
-    unsigned char *block;
+    unsigned char *block; // Null when only measuring
+    size_t inputLength = 0;
 
     int rleCurrentValue = -1;
     int rleLength = 0;
@@ -51,6 +53,12 @@ public:
     {
     }
 
+    // Only tracks the RLE1 length to find where blocks end, the block itself,
+    // its CRC and symbol map are left to the device (kernel_rle1)
+    explicit BlockCompressor(int blockSize) : BlockCompressor(nullptr, nullptr, blockSize)
+    {
+    }
+
     bool isEmpty()
     {
         return blockLength == 0 && rleLength == 0;
@@ -66,6 +74,12 @@ public:
         return blockLength;
     }
 
+    // Input bytes taken by the block so far
+    size_t getInputLength() const
+    {
+        return inputLength;
+    }
+
     bool write(int value)
     {
         if (blockLength > blockLengthLimit)
@@ -92,21 +106,62 @@ public:
             rleCurrentValue = value;
             rleLength = 1;
         }
+        ++inputLength;
         return true;
     }
 
     int write(const std::vector<char> &data, int offset, int length)
     {
-        int written = 0;
-        while (length-- > 0)
+        return static_cast<int>(write(reinterpret_cast<const uint8_t *>(data.data()) + offset, static_cast<size_t>(length)));
+    }
+
+    // Same blocks as calling write(int) for every byte, returns how many bytes
+    // fit. Runs and stretches without runs are handled a word at a time.
+    size_t write(const uint8_t *data, size_t length)
+    {
+        size_t position = 0;
+        while (position < length)
         {
-            if (!write(data[offset++]))
+            if (blockLength > blockLengthLimit)
             {
                 break;
             }
-            ++written;
+
+            if (rleLength == 0)
+            {
+                rleCurrentValue = data[position++];
+                rleLength = 1;
+            }
+            else if (data[position] == rleCurrentValue)
+            {
+                // Extend the run, it is written once it reaches 255
+                size_t runEnd = findRunEnd(data, position, std::min(length, position + 255 - rleLength), data[position]);
+                rleLength += static_cast<int>(runEnd - position);
+                position = runEnd;
+                if (rleLength == 255)
+                {
+                    writeRun(rleCurrentValue, 255);
+                    rleLength = 0;
+                }
+            }
+            else if (rleLength > 1)
+            {
+                writeRun(rleCurrentValue, rleLength);
+                rleCurrentValue = data[position++];
+                rleLength = 1;
+            }
+            else
+            {
+                // Single pending byte followed by bytes that all differ from their
+                // neighbour: each one ends a run of length 1, the last one stays pending
+                const size_t maxLiterals = static_cast<size_t>(blockLengthLimit - blockLength) + 1;
+                size_t literalEnd = findLiteralEnd(data, position, std::min(length, position + maxLiterals));
+                writeLiterals(data + position, literalEnd - position);
+                position = literalEnd;
+            }
         }
-        return written;
+        inputLength += position;
+        return position;
     }
 
     void finishRLE()
@@ -123,16 +178,94 @@ public:
         blockLength = 0;
         rleCurrentValue = -1;
         rleLength = 0;
+        inputLength = 0;
 
-        for (int i = 0; i < 256; ++i)
+        if (blockValuesPresent)
         {
-            blockValuesPresent[i] = false;
+            for (int i = 0; i < 256; ++i)
+            {
+                blockValuesPresent[i] = false;
+            }
         }
     }
 
 private:
+    static uint64_t loadWord(const uint8_t *data)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        return word;
+    }
+
+    // True when any byte of word is zero
+    static bool hasZeroByte(uint64_t word)
+    {
+        return ((word - 0x0101010101010101ULL) & ~word & 0x8080808080808080ULL) != 0;
+    }
+
+    // First index from start on that is not value, at most end
+    static size_t findRunEnd(const uint8_t *data, size_t start, size_t end, uint8_t value)
+    {
+        const uint64_t pattern = 0x0101010101010101ULL * value;
+        size_t i = start;
+        while (i + 8 <= end && loadWord(data + i) == pattern)
+        {
+            i += 8;
+        }
+        while (i < end && data[i] == value)
+        {
+            ++i;
+        }
+        return i;
+    }
+
+    // One past the first byte from start on that equals its successor, the
+    // stretch ends at end at the latest
+    static size_t findLiteralEnd(const uint8_t *data, size_t start, size_t end)
+    {
+        size_t i = start;
+        while (i + 9 <= end && !hasZeroByte(loadWord(data + i) ^ loadWord(data + i + 1)))
+        {
+            i += 8;
+        }
+        while (i + 1 < end && data[i] != data[i + 1])
+        {
+            ++i;
+        }
+        return std::min(i + 1, end);
+    }
+
+    // Ends the pending run of one byte and count - 1 more runs of one byte, the
+    // last literal becomes the pending run
+    void writeLiterals(const uint8_t *literals, size_t count)
+    {
+        writeRun(rleCurrentValue, 1);
+        if (!block)
+        {
+            blockLength += static_cast<int>(count - 1);
+        }
+        else if (count > 1)
+        {
+            std::memcpy(block + blockLength, literals, count - 1);
+            blockLength += static_cast<int>(count - 1);
+            crc.updateCRC(literals, count - 1);
+            for (size_t i = 0; i + 1 < count; ++i)
+            {
+                blockValuesPresent[literals[i]] = true;
+            }
+        }
+        rleCurrentValue = literals[count - 1];
+        rleLength = 1;
+    }
+
     void writeRun(int value, int runLength)
     {
+        if (!block)
+        {
+            blockLength += runLength > 3 ? 5 : runLength;
+            return;
+        }
+
         blockValuesPresent[value] = true;
         crc.updateCRC(value, runLength);
         block[blockLength++] = static_cast<unsigned char>(value);
@@ -26,6 +26,9 @@
 
 #include <vector>
 #include <cstdint>
+#include <cstring>
+#include <climits>
+#include <algorithm>
 #include <iostream>
 
 #include "Config.hpp"
@@ -36,6 +39,8 @@
 
 class BlockDecompressor
 {
+    friend class BlockDecompressorStages; // bzip2-microbench times the inverse BWT stages
+
 public:
     BlockDecompressor(BitInputStream &inputStream, int blockSize)
         : bitInputStream(inputStream),
@@ -91,17 +96,77 @@ public:
 
     int read(std::vector<uint8_t> &destination, int offset, int length)
     {
-        int i;
-        for (i = 0; i < length; i++, offset++)
+        return read(destination.data() + offset, static_cast<size_t>(length));
+    }
+
+    // Inverse BWT, RLE1 expansion and CRC in one pass, runs are written with memset.
+    // Returns the number of bytes written, -1 at the end of the block.
+    int read(uint8_t *destination, size_t length)
+    {
+        length = std::min<size_t>(length, INT_MAX);
+        const int *mergedPointers = bwtMergedPointers.data();
+        int mergedPointer = bwtCurrentMergedPointer;
+        int bytesDecoded = bwtBytesDecoded;
+        int lastByte = rleLastDecodedByte;
+        int accumulator = rleAccumulator;
+        size_t written = 0;
+
+        if (blockRandomised)
+        {
+            throw std::runtime_error("BZip2 randomised blocks not implemented");
+        }
+
+        while (written < length)
         {
-            int decoded = read();
-            if (decoded == -1)
+            if (rleRepeat > 0)
             {
-                return (i == 0) ? -1 : i;
+                // Rest of a run, its CRC is already counted
+                const size_t runBytes = std::min<size_t>(rleRepeat, length - written);
+                std::memset(destination + written, lastByte, runBytes);
+                written += runBytes;
+                rleRepeat -= static_cast<int>(runBytes);
+                continue;
             }
-            destination[offset] = decoded;
+            if (bytesDecoded == bwtBlockLength)
+            {
+                break;
+            }
+
+            const int nextByte = mergedPointer & 0xff;
+            mergedPointer = mergedPointers[mergedPointer >> 8];
+            bytesDecoded++;
+
+            if (nextByte != lastByte)
+            {
+                lastByte = nextByte;
+                accumulator = 1;
+            }
+            else if (++accumulator == 4)
+            {
+                if (bytesDecoded == bwtBlockLength)
+                {
+                    throw std::runtime_error("BZip2 block run length missing");
+                }
+                const int runLength = mergedPointer & 0xff;
+                mergedPointer = mergedPointers[mergedPointer >> 8];
+                bytesDecoded++;
+
+                accumulator = 0;
+                rleRepeat = runLength + 1;
+                crc.updateCRC(nextByte, rleRepeat);
+                continue;
+            }
+
+            crc.updateCRC(nextByte);
+            destination[written++] = static_cast<uint8_t>(nextByte);
         }
-        return i;
+
+        bwtCurrentMergedPointer = mergedPointer;
+        bwtBytesDecoded = bytesDecoded;
+        rleLastDecodedByte = lastByte;
+        rleAccumulator = accumulator;
+
+        return (written == 0 && length > 0) ? -1 : static_cast<int>(written);
     }
 
     int checkCRC()
@@ -165,7 +230,12 @@ private:
         MoveToFront tableMTF;
         for (int i = 0; i < totalSelectors; i++)
         {
-            selectors[i] = tableMTF.indexToFront(bitInputStream.readUnary());
+            int tableIndex = bitInputStream.readUnary();
+            if (tableIndex >= totalTables)
+            {
+                throw std::runtime_error("block Huffman tables invalid");
+            }
+            selectors[i] = tableMTF.indexToFront(tableIndex);
         }
 
         for (int table = 0; table < totalTables; table++)
@@ -177,6 +247,10 @@ private:
                 {
                     currentLength += bitInputStream.readBoolean() ? -1 : 1;
                 }
+                if (currentLength < 1 || currentLength > HUFFMAN_ENCODE_MAXIMUM_CODE_LENGTH)
+                {
+                    throw std::runtime_error("block Huffman tables invalid");
+                }
                 tableCodeLengths[table][j] = currentLength;
             }
         }
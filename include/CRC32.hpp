@@ -26,6 +26,9 @@
 
 #include <array>
 #include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
 
 class CRC32
 {
@@ -64,6 +67,32 @@ private:
         0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0, 0x9abc8bd5, 0x9e7d9662, 0x933eb0bb, 0x97ffad0c,
         0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668, 0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4};
 
+    // Slicing-by-8: entry k advances the CRC of a byte by k more zero bytes
+    using SliceTables = std::array<std::array<uint32_t, 256>, 8>;
+
+    static constexpr SliceTables makeSliceTables()
+    {
+        SliceTables tables{};
+        for (int i = 0; i < 256; ++i)
+        {
+            tables[0][i] = Crc32Lookup[i];
+        }
+        for (int k = 1; k < 8; ++k)
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                tables[k][i] = (tables[k - 1][i] << 8) ^ Crc32Lookup[tables[k - 1][i] >> 24];
+            }
+        }
+        return tables;
+    }
+
+    static const SliceTables &sliceTables()
+    {
+        static constexpr SliceTables tables = makeSliceTables();
+        return tables;
+    }
+
     int crc = 0xffffffff;
 
 public:
@@ -72,17 +101,54 @@ public:
         return ~crc;
     }
 
+    // Stream CRC after one more block: rotated left by one, then combined with the block CRC
+    static int combineStreamCRC(int streamCRC, int blockCRC)
+    {
+        const uint32_t value = static_cast<uint32_t>(streamCRC);
+        return static_cast<int>(((value << 1) | (value >> 31)) ^ static_cast<uint32_t>(blockCRC));
+    }
+
     void updateCRC(int value)
     {
-        crc = (crc << 8) ^ static_cast<int>(Crc32Lookup[((crc >> 24) ^ value) & 0xff]);
+        const uint32_t crcValue = static_cast<uint32_t>(crc);
+        crc = static_cast<int>((crcValue << 8) ^ Crc32Lookup[((crcValue >> 24) ^ value) & 0xff]);
     }
 
     void updateCRC(int value, int count)
     {
-        while (count-- > 0)
+        if (count < 16)
+        {
+            while (count-- > 0)
+            {
+                updateCRC(value);
+            }
+            return;
+        }
+
+        uint8_t run[64];
+        std::memset(run, value & 0xff, sizeof(run));
+        for (; count > 0; count -= static_cast<int>(sizeof(run)))
+        {
+            updateCRC(run, std::min<size_t>(count, sizeof(run)));
+        }
+    }
+
+    void updateCRC(const uint8_t *bytes, size_t length)
+    {
+        const SliceTables &t = sliceTables();
+        uint32_t value = static_cast<uint32_t>(crc);
+        for (; length >= 8; bytes += 8, length -= 8)
+        {
+            value ^= (static_cast<uint32_t>(bytes[0]) << 24) | (static_cast<uint32_t>(bytes[1]) << 16) |
+                     (static_cast<uint32_t>(bytes[2]) << 8) | bytes[3];
+            value = t[7][value >> 24] ^ t[6][(value >> 16) & 0xff] ^ t[5][(value >> 8) & 0xff] ^ t[4][value & 0xff] ^
+                    t[3][bytes[4]] ^ t[2][bytes[5]] ^ t[1][bytes[6]] ^ t[0][bytes[7]];
+        }
+        for (; length > 0; ++bytes, --length)
         {
-            updateCRC(value);
+            value = (value << 8) ^ t[0][(value >> 24) ^ *bytes];
         }
+        crc = static_cast<int>(value);
     }
 
     void reset()
@@ -41,6 +41,7 @@ static constexpr int HUFFMAN_MAXIMUM_TABLES = 6;
 static constexpr int HUFFMAN_MAXIMUM_SELECTORS = (MAX_BLOCK_SIZE / HUFFMAN_GROUP_RUN_LENGTH) + 1;
 static constexpr int HUFFMAN_SYMBOL_RUNA = 0;
 static constexpr int HUFFMAN_SYMBOL_RUNB = 1;
+static constexpr int BLOCK_STATE_SIZE = 4; // Results handed between the stages of a block
 static constexpr int STREAM_END_MARKER_1 = 0x177245;
 static constexpr int STREAM_END_MARKER_2 = 0x385090;
 static constexpr int STREAM_START_MARKER_1 = 0x425a;
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2024 Stanislav Brega
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef DEVICE_PROFILES_HPP
+#define DEVICE_PROFILES_HPP
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Batch configuration measured by --autotune
+struct DeviceProfile
+{
+    int parallelBlockCnt = 0;
+    int workGroupSize = 0;
+};
+
+// Profiles persisted in a tab separated text file, one line per device name,
+// driver version and block size. The file is $BZIP2_OPENCL_PROFILES or
+// .bzip2-opencl-profiles in the home directory.
+class DeviceProfiles
+{
+private:
+    struct Entry
+    {
+        std::string deviceName;
+        std::string driverVersion;
+        int blockSizeMultiplier;
+        DeviceProfile profile;
+    };
+
+    std::string path;
+    std::vector<Entry> entries{};
+
+    static std::string defaultPath()
+    {
+        if (const char *path = std::getenv("BZIP2_OPENCL_PROFILES"))
+        {
+            return path;
+        }
+        const char *home = std::getenv("HOME");
+        if (!home)
+        {
+            home = std::getenv("USERPROFILE");
+        }
+        return std::string(home ? home : ".") + "/.bzip2-opencl-profiles";
+    }
+
+    // Tabs and line breaks would split the fields
+    static std::string sanitize(std::string field)
+    {
+        for (char &c : field)
+        {
+            if (c == '\t' || c == '\n' || c == '\r')
+            {
+                c = ' ';
+            }
+        }
+        return field;
+    }
+
+public:
+    explicit DeviceProfiles(std::string path = defaultPath()) : path(std::move(path))
+    {
+        // A missing or unreadable file is an empty store, malformed lines are skipped
+        std::ifstream file(this->path);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            std::istringstream fields(line);
+            Entry entry;
+            std::string blockSize, parallelBlockCnt, workGroupSize;
+            if (std::getline(fields, entry.deviceName, '\t') &&
+                std::getline(fields, entry.driverVersion, '\t') &&
+                std::getline(fields, blockSize, '\t') &&
+                std::getline(fields, parallelBlockCnt, '\t') &&
+                std::getline(fields, workGroupSize))
+            {
+                entry.blockSizeMultiplier = std::atoi(blockSize.c_str());
+                entry.profile.parallelBlockCnt = std::atoi(parallelBlockCnt.c_str());
+                entry.profile.workGroupSize = std::atoi(workGroupSize.c_str());
+                if (entry.profile.parallelBlockCnt > 0 && entry.profile.workGroupSize > 0)
+                {
+                    entries.push_back(entry);
+                }
+            }
+        }
+    }
+
+    const std::string &getPath() const
+    {
+        return path;
+    }
+
+    bool find(const std::string &deviceName, const std::string &driverVersion, int blockSizeMultiplier, DeviceProfile &profile) const
+    {
+        for (const Entry &entry : entries)
+        {
+            if (entry.deviceName == sanitize(deviceName) && entry.driverVersion == sanitize(driverVersion) &&
+                entry.blockSizeMultiplier == blockSizeMultiplier)
+            {
+                profile = entry.profile;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Adds or replaces the profile and rewrites the file
+    void store(const std::string &deviceName, const std::string &driverVersion, int blockSizeMultiplier, const DeviceProfile &profile)
+    {
+        Entry newEntry{sanitize(deviceName), sanitize(driverVersion), blockSizeMultiplier, profile};
+        bool replaced = false;
+        for (Entry &entry : entries)
+        {
+            if (entry.deviceName == newEntry.deviceName && entry.driverVersion == newEntry.driverVersion &&
+                entry.blockSizeMultiplier == blockSizeMultiplier)
+            {
+                entry = newEntry;
+                replaced = true;
+            }
+        }
+        if (!replaced)
+        {
+            entries.push_back(newEntry);
+        }
+
+        std::ofstream file(path, std::ios::trunc);
+        for (const Entry &entry : entries)
+        {
+            file << entry.deviceName << '\t' << entry.driverVersion << '\t' << entry.blockSizeMultiplier << '\t'
+                 << entry.profile.parallelBlockCnt << '\t' << entry.profile.workGroupSize << '\n';
+        }
+        if (!file)
+        {
+            throw std::runtime_error("Failed to write device profiles to " + path);
+        }
+    }
+};
+#endif
@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2024 Stanislav Brega
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef HOST_KERNEL_HPP
+#define HOST_KERNEL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include "Config.hpp"
+
+// The OpenCL C code of kernel.cpp compiled as plain C++ (kernel_host.cpp), used by
+// the CPU backend, to cross-check device output and to profile single stages
+namespace host_kernel
+{
+#ifndef KERNEL_HOST // kernel.cpp defines these itself, layouts must match
+    struct BitWriter
+    {
+        unsigned char *buffer;
+        size_t byteCount;
+        uint64_t bitAccumulator;
+        unsigned int bitsInAccumulator;
+    };
+
+    struct MTFResult
+    {
+        int mtfLength;
+        int alphabetSize;
+    };
+#else
+    struct BitWriter;
+    struct MTFResult;
+#endif
+
+    // Index returned by get_global_id() for the calling thread
+    extern thread_local unsigned int globalId;
+
+    // Work-group of the calling thread, for kernels whose work items cooperate
+    // (kernel_bwt, kernel_mtf, kernel_huffman_tables, kernel_huffman_emit). The caller runs every
+    // work item of a group on a thread of its own and sets groupBarrier to a barrier shared by them.
+    extern thread_local unsigned int localId;
+    extern thread_local unsigned int localSize;
+    extern thread_local unsigned int groupId;
+    extern thread_local std::function<void()> groupBarrier;
+
+    /* BWT */
+    int DivSufSortBWT(unsigned char *T, int *SA, int *bucketA, int *bucketB, int *tempbuf, int n);
+    int CooperativeBWT(unsigned char *T, int *SA, int *rankBuffers, int n, int *histograms, int *partials, int *counts);
+
+    /* Write bits */
+    void initBitWriter(BitWriter *writer, unsigned char *buffer, size_t bitCount);
+    void writeBits(BitWriter *writer, int count, int value);
+    void flushBitWriter(BitWriter *writer, size_t *bitCount);
+    void writeSymbolMap(BitWriter *writer, bool *blockValuesPresent);
+
+    /* MTF + RLE2 */
+    MTFResult MTFAndRLE2StageEncoder(int *bwtBlock, int bwtLength, bool *bwtValuesInUse, int *mtfSymbolFrequencies, int *huffmanSymbolMap, int *symbolMTF);
+    void CooperativeMTFAndRLE2(int *bwtBlock,
+                               int bwtLength,
+                               bool *bwtValuesInUse,
+                               int *mtfSymbolFrequencies,
+                               int *huffmanSymbolMap,
+                               int *mtfPositions,
+                               int *tables,
+                               int *partials,
+                               int *counts,
+                               int *blockState);
+
+    /* Huffman */
+    int selectTableCount(int mtfLength);
+    void generateHuffmanCodeLengths(int alphabetSize, int *symbolFrequencies, int *codeLengths);
+    void huffmanSeedRanges(int mtfLength, int mtfAlphabetSize, int *mtfSymbolFrequencies, int totalTables, int *lowCostStarts, int *lowCostEnds);
+    void generateHuffmanOptimisationSeeds(int mtfLength,
+                                          int mtfAlphabetSize,
+                                          int *mtfSymbolFrequencies,
+                                          int huffmanCodeLengths[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE],
+                                          int totalTables);
+    void optimiseSelectorsAndHuffmanTables(int *mtfBlock,
+                                           int mtfLength,
+                                           int mtfAlphabetSize,
+                                           int huffmanCodeLengths[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE],
+                                           int totalTables,
+                                           int *selectors,
+                                           bool storeSelectors);
+    void assignTableCodeSymbols(int mtfAlphabetSize, int *codeLengths, int *mergedCodeSymbols);
+    void assignHuffmanCodeSymbols(int mtfAlphabetSize,
+                                  int huffmanCodeLengths[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE],
+                                  int *huffmanMergedCodeSymbols,
+                                  int totalTables);
+    void writeSelectorsAndHuffmanTables(BitWriter *writer,
+                                        int *selectors,
+                                        int selectorsSize,
+                                        int *huffmanMergedCodeSymbols,
+                                        int huffmanCodeLengthsSize,
+                                        int mtfAlphabetSize);
+    void writeBlockData(BitWriter *writer,
+                        int *mtfBlock,
+                        int mtfLength,
+                        int *selectors,
+                        int *huffmanMergedCodeSymbols);
+    void HuffmanStageTables(int *mtfBlock,
+                            int mtfLength,
+                            int mtfAlphabetSize,
+                            int *mtfSymbolFrequencies,
+                            int *selectors,
+                            int *huffmanMergedCodeSymbols);
+    void CooperativeHuffmanTables(int *mtfBlock,
+                                  int mtfLength,
+                                  int mtfAlphabetSize,
+                                  int *mtfSymbolFrequencies,
+                                  int *selectors,
+                                  int *huffmanMergedCodeSymbols,
+                                  int *histograms);
+    void CooperativeHuffmanEmit(int *mtfBlock,
+                                int mtfLength,
+                                int *selectors,
+                                int *huffmanMergedCodeSymbols,
+                                unsigned char *bitBuffer,
+                                size_t *bitCount,
+                                int *bitOffsets,
+                                int *partials,
+                                int *fragments);
+
+    /* Whole block, as run by one work item */
+    void writeBlockTables(BitWriter *writer, bool *blockValuesPresent, int *selectors, int *huffmanMergedCodeSymbols, int *blockState);
+    void close_block(unsigned char *preBWTblock,
+                     int *block,
+                     int blockLength,
+                     int *bucketA,
+                     int *bucketB,
+                     int *bwtTempBuff,
+                     unsigned char *bitBuffer,
+                     size_t *bitCount,
+                     bool *blockValuesPresent,
+                     int *mtfSymbolFrequencies,
+                     int *huffmanSymbolMap,
+                     int *symbolMTF,
+                     int *selectors,
+                     int *huffmanMergedCodeSymbols,
+                     int *blockState);
+
+    /* RLE1 of raw input */
+    void kernel_rle1(unsigned char *rawInput,
+                     uint64_t *rawBlockOffsets,
+                     bool *isEmptyCompressor,
+                     unsigned char *blocks,
+                     size_t *blockLengths,
+                     int *blockCRCs,
+                     bool *blocksValuePresent,
+                     const int blockCnt,
+                     const unsigned int streamBlockSize);
+
+    void kernel_bwt(bool *isEmptyCompressor,
+                    unsigned char *blocks,
+                    int *bwtBlocks,
+                    size_t *blockLengths,
+                    int *bwtRanks,
+                    int *bucketsA,
+                    int *bucketsB,
+                    int *bwtTempBuffs,
+                    int *blockStates,
+                    const int blockCnt,
+                    const unsigned int streamBlockSize);
+
+    void kernel_mtf(bool *isEmptyCompressor,
+                    int *bwtBlocks,
+                    size_t *blockLengths,
+                    bool *blocksValuePresent,
+                    int *mtfsSymbolFrequencies,
+                    int *huffmanSymbolMaps,
+                    int *bwtRanks,
+                    int *bucketsA,
+                    int *bucketsB,
+                    int *bwtTempBuffs,
+                    int *blockStates,
+                    const int blockCnt,
+                    const unsigned int streamBlockSize);
+
+    void writeBlockHeader(unsigned char *bitBuffer, size_t *bitCount, int blockCRC);
+
+    void kernel_close(bool *isEmptyCompressor,
+                      int *blockCRCs,
+                      unsigned char *blocks,
+                      int *bwtBlocks,
+                      size_t *blockLengths,
+                      int *bucketsA,
+                      int *bucketsB,
+                      int *bwtTempBuffs,
+                      unsigned char *bitOutBuffers,
+                      size_t *bitOutCnts,
+                      bool *blocksValuePresent,
+                      int *mtfsSymbolFrequencies,
+                      int *huffmanSymbolMaps,
+                      int *symbolMTFs,
+                      int *huffmanSelectors,
+                      const int blockCnt,
+                      const unsigned int streamBlockSize,
+                      const unsigned int bitOutBufferSize,
+                      int *huffmanCodeTables,
+                      int *blockStates);
+
+    void kernel_huffman_tables(bool *isEmptyCompressor,
+                               int *bwtBlocks,
+                               int *mtfsSymbolFrequencies,
+                               int *huffmanSelectors,
+                               int *huffmanCodeTables,
+                               int *bucketsB,
+                               int *blockStates,
+                               const int blockCnt,
+                               const unsigned int streamBlockSize);
+
+    void kernel_huffman_emit(bool *isEmptyCompressor,
+                             int *blockCRCs,
+                             int *bwtBlocks,
+                             bool *blocksValuePresent,
+                             int *huffmanSelectors,
+                             int *huffmanCodeTables,
+                             unsigned char *bitOutBuffers,
+                             size_t *bitOutCnts,
+                             int *bucketsA,
+                             int *bucketsB,
+                             int *bwtTempBuffs,
+                             int *blockStates,
+                             const int blockCnt,
+                             const unsigned int streamBlockSize,
+                             const unsigned int bitOutBufferSize);
+
+    /* Batch assembly */
+    void kernel_block_offsets(size_t *bitOutCnts,
+                              unsigned int *streamCarry,
+                              unsigned int *batchCarry,
+                              uint64_t *blockBitOffsets,
+                              const int blockCnt);
+
+    void kernel_assemble_blocks(unsigned char *bitOutBuffers,
+                                uint64_t *blockBitOffsets,
+                                unsigned int *batchCarry,
+                                unsigned int *streamCarry,
+                                unsigned char *assembledBuffer,
+                                const int blockCnt,
+                                const unsigned int bitOutBufferSize);
+}
+#endif
@@ -26,20 +26,24 @@
 
 #include <vector>
 #include <cstdint>
+#include <stdexcept>
+#include <algorithm>
 
 #include "Config.hpp"
 #include "BitInputStream.hpp"
 
 class HuffmanStageDecoder
 {
+private:
+    // Codes up to this length are resolved by a single lookup table probe
+    static constexpr int LOOKUP_BITS = 10;
+    static constexpr int LOOKUP_SIZE = 1 << LOOKUP_BITS;
+    static constexpr int LOOKUP_LENGTH_BITS = 5; // Entry is symbol << 5 | code length, 0 for longer codes
+
 public:
     HuffmanStageDecoder(BitInputStream &inputStream, int alphabetSize, const std::vector<std::vector<uint8_t>> &tableCodeLengths, std::vector<uint8_t> sel)
         : bitInputStream(inputStream),
           selectors(sel),
-          minimumLengths(HUFFMAN_MAXIMUM_TABLES),
-          codeBases(HUFFMAN_MAXIMUM_TABLES, std::vector<int>(HUFFMAN_DECODE_MAXIMUM_CODE_LENGTH + 2)),
-          codeLimits(HUFFMAN_MAXIMUM_TABLES, std::vector<int>(HUFFMAN_DECODE_MAXIMUM_CODE_LENGTH + 1)),
-          codeSymbols(HUFFMAN_MAXIMUM_TABLES, std::vector<int>(HUFFMAN_MAXIMUM_ALPHABET_SIZE)),
           currentTable(selectors[0])
     {
         createHuffmanDecodingTables(alphabetSize, tableCodeLengths);
@@ -56,40 +60,53 @@ public:
             }
             currentTable = selectors[groupIndex] & 0xff;
         }
-        int codeLength = minimumLengths[currentTable];
-        int codeBits = bitInputStream.readBits(codeLength);
 
-        while (codeLength <= HUFFMAN_DECODE_MAXIMUM_CODE_LENGTH)
+        const uint16_t entry = lookupTable[currentTable * LOOKUP_SIZE + bitInputStream.peekBits(LOOKUP_BITS)];
+        if (entry != 0)
         {
-            if (codeBits <= codeLimits[currentTable][codeLength])
-            {
-                return codeSymbols[currentTable][codeBits - codeBases[currentTable][codeLength]];
-            }
-            codeBits = (codeBits << 1) | bitInputStream.readBits(1);
-            codeLength++;
+            bitInputStream.consumeBits(entry & ((1 << LOOKUP_LENGTH_BITS) - 1));
+            return entry >> LOOKUP_LENGTH_BITS;
         }
-
-        throw std::runtime_error("Error decoding  block");
+        return nextLongSymbol();
     }
 
 private:
     BitInputStream &bitInputStream;
     std::vector<uint8_t> selectors;
-    std::vector<int> minimumLengths;
-    std::vector<std::vector<int>> codeBases;
-    std::vector<std::vector<int>> codeLimits;
-    std::vector<std::vector<int>> codeSymbols;
+    alignas(64) uint16_t lookupTable[HUFFMAN_MAXIMUM_TABLES * LOOKUP_SIZE] = {0}; // All groups in one array
+    int minimumLengths[HUFFMAN_MAXIMUM_TABLES] = {0};
+    int maximumLengths[HUFFMAN_MAXIMUM_TABLES] = {0};
+    int codeBases[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_DECODE_MAXIMUM_CODE_LENGTH + 2] = {{0}};
+    int codeLimits[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_DECODE_MAXIMUM_CODE_LENGTH + 1] = {{0}};
+    int codeSymbols[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE] = {{0}};
     int currentTable;
     int groupIndex = -1;
     int groupPosition = -1;
 
+    // Codes longer than LOOKUP_BITS, checked one length at a time against the canonical limits
+    int nextLongSymbol()
+    {
+        const unsigned int codeBits = bitInputStream.peekBits(HUFFMAN_DECODE_MAXIMUM_CODE_LENGTH);
+        for (int codeLength = std::max(LOOKUP_BITS + 1, minimumLengths[currentTable]); codeLength <= maximumLengths[currentTable]; codeLength++)
+        {
+            const int code = static_cast<int>(codeBits >> (HUFFMAN_DECODE_MAXIMUM_CODE_LENGTH - codeLength));
+            if (code <= codeLimits[currentTable][codeLength])
+            {
+                bitInputStream.consumeBits(codeLength);
+                return codeSymbols[currentTable][code - codeBases[currentTable][codeLength]];
+            }
+        }
+
+        throw std::runtime_error("Error decoding  block");
+    }
+
     void createHuffmanDecodingTables(int alphabetSize, const std::vector<std::vector<uint8_t>> &tableCodeLengths)
     {
         for (size_t table = 0; table < tableCodeLengths.size(); table++)
         {
-            std::vector<int> &bases = codeBases[table];
-            std::vector<int> &limits = codeLimits[table];
-            std::vector<int> &symbols = codeSymbols[table];
+            int *bases = codeBases[table];
+            int *limits = codeLimits[table];
+            int *symbols = codeSymbols[table];
             const std::vector<uint8_t> &lengths = tableCodeLengths[table];
 
             int minimumLength = HUFFMAN_DECODE_MAXIMUM_CODE_LENGTH;
@@ -101,6 +118,7 @@ private:
                 minimumLength = std::min(static_cast<int>(lengths[i]), minimumLength);
             }
             minimumLengths[table] = minimumLength;
+            maximumLengths[table] = maximumLength;
 
             for (int i = 0; i < alphabetSize; i++)
             {
@@ -121,7 +139,11 @@ private:
                 code <<= 1;
             }
 
+            // Symbols in canonical code order, codes up to LOOKUP_BITS long also fill every
+            // lookup entry they are a prefix of
+            uint16_t *lookup = lookupTable + table * LOOKUP_SIZE;
             int codeIndex = 0;
+            int symbolCode = 0;
             for (int bitLength = minimumLength; bitLength <= maximumLength; bitLength++)
             {
                 for (int symbol = 0; symbol < alphabetSize; symbol++)
@@ -129,10 +151,22 @@ private:
                     if (lengths[symbol] == bitLength)
                     {
                         symbols[codeIndex++] = symbol;
+                        if (bitLength >= 1 && bitLength <= LOOKUP_BITS)
+                        {
+                            const int shift = LOOKUP_BITS - bitLength;
+                            if (((symbolCode + 1) << shift) > LOOKUP_SIZE)
+                            {
+                                throw std::runtime_error("block Huffman tables invalid");
+                            }
+                            std::fill(lookup + (symbolCode << shift), lookup + ((symbolCode + 1) << shift),
+                                      static_cast<uint16_t>((symbol << LOOKUP_LENGTH_BITS) | bitLength));
+                        }
+                        symbolCode++;
                     }
                 }
+                symbolCode <<= 1;
             }
         }
     }
 };
-#endif
\ No newline at end of file
+#endif
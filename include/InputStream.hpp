@@ -72,6 +72,12 @@ public:
     }
 
     int read(std::vector<uint8_t> &buffer, int offset, int length)
+    {
+        return read(buffer.data() + offset, static_cast<size_t>(length));
+    }
+
+    // Up to length bytes of the current block, -1 at the end of the stream
+    int read(uint8_t *buffer, size_t length)
     {
         int bytesRead = -1;
         if (!blockDecompressor)
@@ -80,14 +86,14 @@ public:
         }
         else
         {
-            bytesRead = blockDecompressor->read(buffer, offset, length);
+            bytesRead = blockDecompressor->read(buffer, length);
         }
 
         if (bytesRead == -1)
         {
             if (initializeNextBlock())
             {
-                bytesRead = blockDecompressor->read(buffer, offset, length);
+                bytesRead = blockDecompressor->read(buffer, length);
             }
         }
 
@@ -129,7 +135,7 @@ private:
         if (blockDecompressor)
         {
             int blockCRC = blockDecompressor->checkCRC();
-            streamCRC = ((streamCRC << 1) | (static_cast<unsigned int>(streamCRC) >> 31)) ^ blockCRC;
+            streamCRC = CRC32::combineStreamCRC(streamCRC, blockCRC);
         }
 
         int marker1 = bitInputStream.readBits(24);
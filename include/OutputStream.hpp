@@ -26,48 +26,124 @@
 
 #include <ostream>
 #include <memory>
+#include <algorithm>
+#include <climits>
 #include <bitset>
+#include <future>
+#include <thread>
 
 #include "BitOutputStream.hpp"
 #include "BlockCompressor.hpp"
+#include "HostKernel.hpp"
+#include "StageTimings.hpp"
+#include "ThreadPool.hpp"
+#include "DeviceProfiles.hpp"
 #include "opencl.hpp"
 
+enum class CompressionBackend
+{
+    Auto,   // OpenCL if a device is found and the program builds, CPU otherwise
+    OpenCL, // Stage kernels on the OpenCL device with the most FLOPS
+    CPU     // kernel_close compiled for the host, one block per thread pool task
+};
+
 class OutputStream
 {
 private:
+    // One set of host/device buffers for a batch of parallelBlockCnt blocks.
+    // Slots are used round-robin so the host can fill one batch while the
+    // previous ones are still being compressed or transferred by the device.
+    struct CompressionSlot
+    {
+        std::vector<BlockCompressor> blockCompressors{};
+        Memory<unsigned char> bitOutBuffers{};
+        Memory<size_t> bitOutCnts{};
+        Memory<int> blockCRCs{};
+        Memory<unsigned char> inputBlocks{};
+        Memory<size_t> inputBlockSizes{};
+        Memory<int> bwtBlocks{};
+        Memory<int> bwtBucketsA{};
+        Memory<int> bwtBucketsB{};
+        Memory<int> bwtTempBuffs{};
+        Memory<bool> blocksValuePresent{};
+        Memory<bool> isEmptyCompressor{};
+        Memory<int> mtfsSymbolFrequencies{};
+        Memory<int> huffmanSymbolMaps{};
+        Memory<int> symbolMTFs{};
+        Memory<int> huffmanSelectors{};
+        Memory<int> huffmanCodeTables{};         // Merged code symbols of every table, for the emission stage
+        Memory<int> blockStates{};               // Results handed between the stages of each block
+        Memory<int> bwtRanks{};                  // Device only, rank buffers of kernel_bwt
+        Memory<ulong> blockBitOffsets{};         // Device only, from kernel_block_offsets
+        Memory<uint> batchCarry{};               // Stream carry as it was before this batch
+        Memory<unsigned char> assembledBuffer{}; // Whole bytes of the batch, stream aligned
+        Memory<unsigned char> rawInput{};        // Only with RLE1 on the device, grows as needed
+        Memory<ulong> rawBlockOffsets{};
+        size_t rawInputSize = 0UL;
+        std::unique_ptr<Kernel> kernel_rle1;
+        std::unique_ptr<Kernel> kernel_bwt;
+        std::unique_ptr<Kernel> kernel_mtf;
+        std::unique_ptr<Kernel> kernel_huffman_tables;
+        std::unique_ptr<Kernel> kernel_huffman_emit;
+        std::unique_ptr<Kernel> kernel_block_offsets;
+        std::unique_ptr<Kernel> kernel_assemble_blocks;
+        Event transferDone{};
+        std::vector<std::future<void>> blockTasks{};
+        Memory<unsigned char> verifyBitOutBuffers{}; // Host results for --verify
+        Memory<size_t> verifyBitOutCnts{};
+        std::vector<Event> writeEvents{}; // Profiling events, only with timings
+        Event rleEvent{};
+        Event bwtEvent{};
+        Event mtfEvent{};
+        Event tablesEvent{};
+        Event emitEvent{};
+        std::vector<Event> assemblyEvents{};
+        Event readEvent{};
+        std::vector<double> hostBlockSeconds{};
+        int liveBlockCnt = 0;            // Blocks up to the last non-empty one, the rest isn't transferred
+        size_t assembledReadBytes = 0UL; // Part of assembledBuffer read back with the batch
+        bool inFlight = false;
+    };
+
     std::ostream &outputStream;
     bool streamFinished = false;
     int streamBlockSize;
     int parallelBlockCnt;
+    int workGroupSize = 0; // Stage kernels, from the device profile or autotune, 0 = as large as each allows
+    uint bwtGroupSize = 0U; // Work items sharing one block in each stage kernel
+    uint mtfGroupSize = 0U;
+    uint tablesGroupSize = 0U;
+    uint emitGroupSize = 0U;
+    size_t inputLength;
     int streamCRC = 0;
     int compressorIdx = 0;
+    int slotIdx = 0;
+    bool verifyOnHost;
+    bool rleOnDevice;
     size_t BIT_BLOCK_MAX_SIZE;
-    std::vector<BlockCompressor> blockCompressors{};
-    Memory<bool> bitOutBuffers{};
-    Memory<size_t> bitOutCnts{};
-    Memory<unsigned char> inputBlocks{};
-    Memory<size_t> inputBlockSizes{};
-    Memory<int> bwtBlocks{};
-    Memory<int> bwtBucketsA{};
-    Memory<int> bwtBucketsB{};
-    Memory<int> bwtTempBuffs{};
-    Memory<bool> blocksValuePresent{};
-    Memory<bool> isEmptyCompressor{};
-    Memory<int> mtfsSymbolFrequencies{};
-    Memory<int> huffmanSymbolMaps{};
-    Memory<int> symbolMTFs{};
-    Memory<int> huffmanSelectors{};
-    // Device device;
-    Device device{select_device_with_most_flops()};
-    std::unique_ptr<Kernel> kernel_close;
+    BitStitcher bitStitcher{}; // Output not written yet, at most a partial byte between batches
+    std::unique_ptr<Device> device;
+    Memory<uint> streamCarry{}; // Partial last byte of the device output, MSB aligned, and its bit count
+    std::vector<std::unique_ptr<CompressionSlot>> slots{};
+    std::unique_ptr<StageTimings> timings; // Only when collecting timings
+    Clock fillClock;
+    std::unique_ptr<ThreadPool> threadPool; // Destroyed first, tasks reference the slots
 
 public:
     OutputStream(std::ostream &out,
                  int blockSizeMultiplier,
-                 int parallelBlockCnt) : outputStream(out),
-                                         streamBlockSize(BLOCKSIZE_DEFAULT * blockSizeMultiplier),
-                                         parallelBlockCnt(parallelBlockCnt),
-                                         BIT_BLOCK_MAX_SIZE(16ll * streamBlockSize)
+                 int parallelBlockCnt,
+                 int pipelineSlots = 2,
+                 CompressionBackend backend = CompressionBackend::Auto,
+                 int threadCnt = 0,
+                 bool verifyOnHost = false,
+                 bool collectTimings = false,
+                 bool rleOnDevice = false,
+                 size_t inputLength = 0) : outputStream(out),
+                                                streamBlockSize(BLOCKSIZE_DEFAULT * blockSizeMultiplier),
+                                                parallelBlockCnt(parallelBlockCnt),
+                                                inputLength(inputLength),
+                                                BIT_BLOCK_MAX_SIZE(maxCompressedBlockSize(streamBlockSize))
 
     {
         if (blockSizeMultiplier < 1 || blockSizeMultiplier > 9)
@@ -75,57 +151,102 @@ public:
             throw std::invalid_argument("Invalid block size");
         }
 
-        if (parallelBlockCnt < 1)
+        // 0 sizes batches from the device profile or the backend, see autoParallelBlockCnt
+        if (parallelBlockCnt < 0)
         {
             throw std::invalid_argument("Invalid parallel block count");
         }
 
-        bitOutBuffers = Memory<bool>(device, BIT_BLOCK_MAX_SIZE * parallelBlockCnt);
-        bitOutCnts = Memory<size_t>(device, parallelBlockCnt);
-        isEmptyCompressor = Memory<bool>(device, parallelBlockCnt);
-        inputBlocks = Memory<unsigned char>(device, streamBlockSize * parallelBlockCnt);
-        inputBlockSizes = Memory<size_t>(device, parallelBlockCnt);
-        bwtBlocks = Memory<int>(device, streamBlockSize * parallelBlockCnt);
-        bwtBucketsA = Memory<int>(device, BWT_BUCKET_A_SIZE * parallelBlockCnt);
-        bwtBucketsB = Memory<int>(device, BWT_BUCKET_B_SIZE * parallelBlockCnt);
-        bwtTempBuffs = Memory<int>(device, ALPHABET_SIZE * parallelBlockCnt);
-        blocksValuePresent = Memory<bool>(device, ALPHABET_SIZE * parallelBlockCnt);
-        mtfsSymbolFrequencies = Memory<int>(device, ALPHABET_SIZE * parallelBlockCnt);
-        huffmanSymbolMaps = Memory<int>(device, ALPHABET_SIZE * parallelBlockCnt);
-        symbolMTFs = Memory<int>(device, ALPHABET_SIZE * parallelBlockCnt);
-        huffmanSelectors = Memory<int>(device, ((streamBlockSize + HUFFMAN_GROUP_RUN_LENGTH - 1) / HUFFMAN_GROUP_RUN_LENGTH) * parallelBlockCnt);
-
-        kernel_close.reset(new Kernel{device,
-                                      parallelBlockCnt,
-                                      "kernel_close",
-                                      isEmptyCompressor,
-                                      inputBlocks,
-                                      bwtBlocks,
-                                      inputBlockSizes,
-                                      bwtBucketsA,
-                                      bwtBucketsB,
-                                      bwtTempBuffs,
-                                      bitOutBuffers,
-                                      bitOutCnts,
-                                      blocksValuePresent,
-                                      mtfsSymbolFrequencies,
-                                      huffmanSymbolMaps,
-                                      symbolMTFs,
-                                      huffmanSelectors,
-                                      parallelBlockCnt,
-                                      streamBlockSize});
+        if (pipelineSlots < 1)
+        {
+            throw std::invalid_argument("Invalid pipeline slot count");
+        }
 
-        for (int i = 0; i < parallelBlockCnt; ++i)
+        if (threadCnt < 0)
+        {
+            throw std::invalid_argument("Invalid thread count");
+        }
+
+        if (backend == CompressionBackend::OpenCL)
+        {
+            device.reset(new Device(select_device_with_most_flops()));
+        }
+        else if (backend == CompressionBackend::Auto)
+        {
+            device = probeDevice();
+        }
+
+        // Host results are only needed to check a device
+        this->verifyOnHost = verifyOnHost && device;
+        this->rleOnDevice = rleOnDevice && device;
+        if (collectTimings)
+        {
+            timings.reset(new StageTimings());
+            if (device)
+            {
+                device->enable_profiling();
+            }
+        }
+        if (!device || this->verifyOnHost)
+        {
+            // All hardware threads by default
+            threadPool.reset(new ThreadPool(threadCnt ? threadCnt : std::max(1U, std::thread::hardware_concurrency())));
+        }
+
+        if (device)
+        {
+            print_info("Compression backend: OpenCL on " + device->info.name);
+        }
+        else
         {
-            blockCompressors.emplace_back(inputBlocks.data() + i * streamBlockSize,
-                                          blocksValuePresent.data() + i * ALPHABET_SIZE,
-                                          streamBlockSize);
+            print_info("Compression backend: CPU with " + std::to_string(threadPool->size()) + " threads");
         }
 
-        // Initial block has stream start info
-        writeBits(bitOutBuffers.data(), &(bitOutCnts[0]), 16, STREAM_START_MARKER_1);
-        writeBits(bitOutBuffers.data(), &(bitOutCnts[0]), 8, STREAM_START_MARKER_2);
-        writeBits(bitOutBuffers.data(), &(bitOutCnts[0]), 8, '0' + blockSizeMultiplier);
+        DeviceProfile profile;
+        if (this->parallelBlockCnt == 0 && device &&
+            DeviceProfiles().find(device->info.name, device->info.driver_version, blockSizeMultiplier, profile))
+        {
+            // Measured by an earlier autotune, still within this run's memory and input
+            this->parallelBlockCnt = static_cast<int>(std::min({static_cast<size_t>(profile.parallelBlockCnt),
+                                                                memoryBlockLimit(pipelineSlots),
+                                                                inputBlockLimit(inputLength)}));
+            workGroupSize = profile.workGroupSize;
+            print_info("Batch size: " + std::to_string(this->parallelBlockCnt) + " blocks, work-group size " +
+                       std::to_string(workGroupSize) + " from the device profile");
+        }
+        else if (this->parallelBlockCnt == 0)
+        {
+            this->parallelBlockCnt = autoParallelBlockCnt(pipelineSlots, inputLength);
+            print_info("Batch size: " + std::to_string(this->parallelBlockCnt) + " blocks");
+        }
+
+        if (device)
+        {
+            setStageGroupSizes();
+            streamCarry = Memory<uint>(*device, 2);
+        }
+        for (int i = 0; i < pipelineSlots; ++i)
+        {
+            slots.emplace_back(createSlot());
+        }
+
+        // Stream start info goes out with the first batch
+        unsigned char streamHeader[4];
+        size_t streamHeaderCnt = 0UL;
+        writeBits(streamHeader, &streamHeaderCnt, 16, STREAM_START_MARKER_1);
+        writeBits(streamHeader, &streamHeaderCnt, 8, STREAM_START_MARKER_2);
+        writeBits(streamHeader, &streamHeaderCnt, 8, '0' + blockSizeMultiplier);
+        bitStitcher.append(streamHeader, streamHeaderCnt);
+        fillClock.start();
+    }
+
+    ~OutputStream()
+    {
+        // Pending transfers still reference the host buffers of the slots
+        if (device)
+        {
+            device->finish_queue();
+        }
     }
 
     void write(int value)
@@ -134,109 +255,1006 @@ public:
         {
             throw std::runtime_error("Write beyond end of stream");
         }
-        if (!blockCompressors[compressorIdx].write(value & 0xff))
+        if (!currentCompressor().write(value & 0xff))
         {
             getNextCompressor();
-            blockCompressors[compressorIdx].write(value & 0xff);
+            currentCompressor().write(value & 0xff);
+        }
+        if (rleOnDevice)
+        {
+            const uint8_t byte = static_cast<uint8_t>(value);
+            appendRawInput(*slots[slotIdx], &byte, 1);
         }
     }
 
     void write(const std::vector<char> &data, int offset, int length)
+    {
+        write(reinterpret_cast<const uint8_t *>(data.data()) + offset, static_cast<size_t>(length));
+    }
+
+    void write(const uint8_t *data, size_t length)
     {
         if (streamFinished)
         {
             throw std::runtime_error("Write beyond end of stream");
         }
 
-        int bytesWritten = 0;
         while (length > 0)
         {
-            if ((bytesWritten = blockCompressors[compressorIdx].write(data, offset, length)) < length)
+            size_t bytesWritten = currentCompressor().write(data, length);
+            if (rleOnDevice)
+            {
+                appendRawInput(*slots[slotIdx], data, bytesWritten);
+            }
+            if (bytesWritten < length)
             {
                 getNextCompressor();
             }
-            offset += bytesWritten;
+            data += bytesWritten;
             length -= bytesWritten;
         }
     }
 
+    // Compresses batches of the sample on the device at several batch and
+    // stage kernel work-group sizes and keeps the fastest, timed from the first
+    // transfer to the last read. The winner is stored as the profile of the device
+    // for later runs. Only before the first write, the sample is not part of the stream.
+    void autotune(const uint8_t *sample, size_t length)
+    {
+        if (!device)
+        {
+            throw std::runtime_error("Autotuning needs an OpenCL device");
+        }
+        if (length == 0)
+        {
+            throw std::invalid_argument("Empty autotuning sample");
+        }
+        if (streamFinished || slotIdx != 0 || compressorIdx != 0 || !currentCompressor().isEmpty())
+        {
+            throw std::runtime_error("Autotuning after the stream was written to");
+        }
+
+        const int pipelineSlots = static_cast<int>(slots.size());
+        const size_t occupancy = occupancyBlockCnt();
+        std::vector<size_t> blockCnts{occupancy / 4, occupancy / 2, occupancy, occupancy * 2};
+        blockCnts.erase(std::unique(blockCnts.begin(), blockCnts.end()), blockCnts.end());
+        const size_t memoryLimit = memoryBlockLimit(pipelineSlots);
+        workGroupSize = 0;
+        setStageGroupSizes();
+        const uint maxWorkGroupSize = std::max({bwtGroupSize, mtfGroupSize, tablesGroupSize, emitGroupSize});
+
+        // Each stage kernel clamps the size to its own limits, larger ones change nothing
+        std::vector<uint> candidates;
+        for (uint candidate : {32U, 64U, 128U, 256U})
+        {
+            if (candidate <= maxWorkGroupSize)
+            {
+                candidates.push_back(candidate);
+            }
+        }
+        if (candidates.empty())
+        {
+            candidates.push_back(maxWorkGroupSize);
+        }
+
+        // Trial slots take the memory of the pipeline
+        slots.clear();
+        DeviceProfile best;
+        double bestRate = 0.0;
+        for (size_t blockCnt : blockCnts)
+        {
+            if (blockCnt < 1 || blockCnt > memoryLimit || blockCnt > INT_MAX)
+            {
+                continue;
+            }
+
+            parallelBlockCnt = static_cast<int>(blockCnt);
+            std::unique_ptr<CompressionSlot> slot = createSlot();
+            const size_t inputBytes = fillTrialSlot(*slot, sample, length);
+            prepareBlocks(*slot);
+            for (uint candidate : candidates)
+            {
+                // The first launch of a size may pay for warm up, the better of two counts
+                workGroupSize = static_cast<int>(candidate);
+                setStageGroupSizes();
+                for (int repetition = 0; repetition < 2; ++repetition)
+                {
+                    Clock batchClock;
+                    submitDeviceBlocks(*slot);
+                    slot->transferDone.wait();
+                    const double rate = inputBytes / std::max(batchClock.stop(), 1e-9);
+                    if (rate > bestRate)
+                    {
+                        bestRate = rate;
+                        best.parallelBlockCnt = parallelBlockCnt;
+                        best.workGroupSize = workGroupSize;
+                    }
+                }
+            }
+            print_info("Autotune: " + std::to_string(blockCnt) + " blocks per batch, best " +
+                       std::to_string(static_cast<int>(bestRate / 1048576.0)) + " MB/s so far");
+        }
+        if (best.parallelBlockCnt == 0)
+        {
+            throw std::runtime_error("No batch size fits the device memory");
+        }
+
+        DeviceProfiles profiles;
+        profiles.store(device->info.name, device->info.driver_version, streamBlockSize / BLOCKSIZE_DEFAULT, best);
+        print_info("Batch size: " + std::to_string(best.parallelBlockCnt) + " blocks, work-group size " + std::to_string(best.workGroupSize));
+        print_info("Saved to " + profiles.getPath());
+
+        // The trials moved the stream carry along, the stream starts over
+        parallelBlockCnt = static_cast<int>(std::min(static_cast<size_t>(best.parallelBlockCnt), inputBlockLimit(inputLength)));
+        workGroupSize = best.workGroupSize;
+        setStageGroupSizes();
+        streamCarry[0] = 0U;
+        streamCarry[1] = 0U;
+        streamCarry.write_to_device();
+        for (int i = 0; i < pipelineSlots; ++i)
+        {
+            slots.emplace_back(createSlot());
+        }
+        fillClock.start();
+    }
+
+    int getParallelBlockCnt() const
+    {
+        return parallelBlockCnt;
+    }
+
+    int getWorkGroupSize() const
+    {
+        return workGroupSize;
+    }
+
     void close()
     {
         if (!streamFinished)
         {
             streamFinished = true;
-            closeBlocks();
-            writeBits(bitOutBuffers.data(), &(bitOutCnts[0]), 24, STREAM_END_MARKER_1);
-            writeBits(bitOutBuffers.data(), &(bitOutCnts[0]), 24, STREAM_END_MARKER_2);
-            writeInteger(bitOutBuffers.data(), &(bitOutCnts[0]), streamCRC);
-            padding(bitOutBuffers.data(), &(bitOutCnts[0]));
-            writeFileBytes(bitOutBuffers.data(), &(bitOutCnts[0]), outputStream, {}); // No leftover
+            submitBlocks();
+
+            // Drain the remaining batches, oldest first
+            for (size_t i = 0; i < slots.size(); ++i)
+            {
+                auto &slot = *slots[(slotIdx + i) % slots.size()];
+                if (slot.inFlight)
+                {
+                    collectBlocks(slot);
+                }
+            }
+
+            if (device)
+            {
+                // Batches were joined on the device, only the carry is left
+                streamCarry.read_from_device();
+                const unsigned char carry = static_cast<unsigned char>(streamCarry[0]);
+                bitStitcher.append(&carry, streamCarry[1]);
+            }
+
+            // End marker + CRC + padding
+            unsigned char streamFooter[10];
+            size_t streamFooterCnt = 0UL;
+            writeBits(streamFooter, &streamFooterCnt, 24, STREAM_END_MARKER_1);
+            writeBits(streamFooter, &streamFooterCnt, 24, STREAM_END_MARKER_2);
+            writeInteger(streamFooter, &streamFooterCnt, streamCRC);
+            bitStitcher.append(streamFooter, streamFooterCnt);
+            bitStitcher.finish(outputStream);
             outputStream.flush();
+
+            if (timings)
+            {
+                timings->report(std::cout);
+            }
         }
     }
 
 private:
+    // Worst case size in bytes of one compressed block, block header included
+    static size_t maxCompressedBlockSize(size_t blockSize)
+    {
+        const size_t maxSelectors = (blockSize + HUFFMAN_GROUP_RUN_LENGTH) / HUFFMAN_GROUP_RUN_LENGTH;
+        size_t bits = 24 + 24 + 32 + 1;                                          // Block header
+        bits += 24;                                                              // BWT start pointer
+        bits += 16 + 16 * 16;                                                    // Symbol map
+        bits += 3 + 15 + HUFFMAN_MAXIMUM_TABLES * maxSelectors;                  // Selectors, unary up to 6 bits
+        bits += HUFFMAN_MAXIMUM_TABLES * (5 + HUFFMAN_MAXIMUM_ALPHABET_SIZE * 39); // Tables, delta up to 19 * 2 + 1 bits
+        bits += HUFFMAN_ENCODE_MAXIMUM_CODE_LENGTH * (blockSize + 1);            // Block data, end of block included
+        return (bits + 7) / 8;
+    }
+
+    // Upper bound of the RLE1 length of a live block
+    size_t blockSizeBound(const CompressionSlot &slot, int blockIdx) const
+    {
+        if (rleOnDevice)
+        {
+            return std::min<size_t>(slot.rawBlockOffsets[blockIdx + 1] - slot.rawBlockOffsets[blockIdx], streamBlockSize);
+        }
+        return slot.inputBlockSizes[blockIdx];
+    }
+
+    // Compressed size read back with the batch, incompressible blocks grow by
+    // far less. Whatever lies beyond is read once the batch is done.
+    static size_t expectedCompressedBlockSize(size_t blockSize)
+    {
+        return std::min(maxCompressedBlockSize(blockSize), blockSize + blockSize / 8 + 4096);
+    }
+
+    // Bytes all buffers of a slot take per block of the batch
+    size_t slotBytesPerBlock() const
+    {
+        const size_t blockStride = streamBlockSize + 1;
+        const size_t selectorStride = (streamBlockSize + HUFFMAN_GROUP_RUN_LENGTH) / HUFFMAN_GROUP_RUN_LENGTH;
+        size_t bytes = 2 * BIT_BLOCK_MAX_SIZE;                         // bitOutBuffers, assembledBuffer
+        bytes += blockStride * (sizeof(unsigned char) + sizeof(int)); // inputBlocks, bwtBlocks
+        bytes += (BWT_BUCKET_A_SIZE + BWT_BUCKET_B_SIZE + ALPHABET_SIZE) * sizeof(int);
+        bytes += (HUFFMAN_MAXIMUM_ALPHABET_SIZE + 2 * ALPHABET_SIZE + selectorStride) * sizeof(int);
+        bytes += HUFFMAN_MAXIMUM_TABLES * HUFFMAN_MAXIMUM_ALPHABET_SIZE * sizeof(int); // huffmanCodeTables
+        bytes += ALPHABET_SIZE * sizeof(bool) + 3 * sizeof(size_t) + (1 + BLOCK_STATE_SIZE) * sizeof(int) + sizeof(bool);
+        if (device)
+        {
+            bytes += 2 * blockStride * sizeof(int); // bwtRanks
+        }
+        if (rleOnDevice)
+        {
+            bytes += blockStride + sizeof(ulong); // rawInput at its initial size, rawBlockOffsets
+        }
+        return bytes;
+    }
+
+    // A block for every lane of every compute unit, the stage kernels run a work-group per
+    // block and get enough of them to cover their serial parts
+    size_t occupancyBlockCnt() const
+    {
+        return static_cast<size_t>(device->info.compute_units) * device->get_preferred_workgroup_multiple("kernel_bwt");
+    }
+
+    // Work items per block of a stage kernel: the tuned size, or the largest the kernel can
+    // be launched with, within the per work item scratch space of a block
+    uint stageGroupSize(const char *kernelName, uint scratchLimit) const
+    {
+        const uint groupSize = std::min(scratchLimit, device->get_max_workgroup_size(kernelName));
+        return workGroupSize > 0 ? std::min(groupSize, static_cast<uint>(workGroupSize)) : groupSize;
+    }
+
+    // kernel_bwt, kernel_mtf and kernel_huffman_emit keep up to ALPHABET_SIZE ints per work item
+    // in the BWT buckets of a block, kernel_huffman_tables caps its histograms itself
+    void setStageGroupSizes()
+    {
+        bwtGroupSize = stageGroupSize("kernel_bwt", ALPHABET_SIZE);
+        mtfGroupSize = stageGroupSize("kernel_mtf", ALPHABET_SIZE);
+        tablesGroupSize = stageGroupSize("kernel_huffman_tables", UINT_MAX);
+        emitGroupSize = stageGroupSize("kernel_huffman_emit", ALPHABET_SIZE);
+    }
+
+    // Most blocks per batch the device memory holds: three quarters of global
+    // memory for all slots, and the largest buffer (bitOutBuffers, bwtRanks or
+    // bwtBucketsB) within one allocation
+    size_t memoryBlockLimit(int pipelineSlots) const
+    {
+        const size_t memoryBytes = static_cast<size_t>(device->info.memory) * 1048576UL;
+        const size_t allocBytes = static_cast<size_t>(device->info.max_global_buffer) * 1048576UL;
+        const size_t largestPerBlock = std::max({BIT_BLOCK_MAX_SIZE,
+                                                 2 * (streamBlockSize + 1) * sizeof(int),
+                                                 static_cast<size_t>(BWT_BUCKET_B_SIZE) * sizeof(int)});
+        return std::max<size_t>(1, std::min(memoryBytes / 4 * 3 / (slotBytesPerBlock() * pipelineSlots), allocBytes / largestPerBlock));
+    }
+
+    // Blocks the whole input fills, no limit when its length is unknown (0)
+    size_t inputBlockLimit(size_t inputLength) const
+    {
+        if (inputLength == 0)
+        {
+            return INT_MAX;
+        }
+
+        // RLE1 grows input by a quarter at most
+        const size_t blockLimit = streamBlockSize - 6;
+        return std::max<size_t>(1, (inputLength + inputLength / 4 + blockLimit - 1) / blockLimit);
+    }
+
+    // Blocks per batch when none is given and the device has no profile. A device
+    // gets its occupancy as far as its memory allows, the CPU backend two blocks
+    // per thread. Never more than the input needs when its length is known.
+    int autoParallelBlockCnt(int pipelineSlots, size_t inputLength) const
+    {
+        size_t blockCnt = device ? std::min(occupancyBlockCnt(), memoryBlockLimit(pipelineSlots)) : 2 * threadPool->size();
+        blockCnt = std::min(blockCnt, inputBlockLimit(inputLength));
+        return static_cast<int>(std::max<size_t>(1, std::min<size_t>(blockCnt, INT_MAX)));
+    }
+
+    // Device with the most FLOPS, or none if there is no device or the program
+    // doesn't build for it
+    static std::unique_ptr<Device> probeDevice()
+    {
+        const std::vector<Device_Info> devices = get_devices(false, false);
+        if (devices.empty())
+        {
+            print_info("No OpenCL device found.");
+            return nullptr;
+        }
+
+        std::unique_ptr<Device> device(new Device(select_device_with_most_flops(devices), get_opencl_c_code(), false));
+        if (!device->is_initialized())
+        {
+            return nullptr;
+        }
+        return device;
+    }
+
+    // Device buffers for the OpenCL backend, host only buffers for the CPU backend
+    template <typename T>
+    void allocate(Memory<T> &memory, size_t length)
+    {
+        if (device)
+        {
+            memory = Memory<T>(*device, length);
+        }
+        else
+        {
+            memory = Memory<T>(length);
+        }
+    }
+
+    std::unique_ptr<CompressionSlot> createSlot()
+    {
+        // Blocks hold up to streamBlockSize bytes plus one for the BWT wraparound
+        const size_t blockStride = streamBlockSize + 1;
+        // The MTF stage can emit one symbol more than the block length (end of block)
+        const size_t selectorStride = (streamBlockSize + HUFFMAN_GROUP_RUN_LENGTH) / HUFFMAN_GROUP_RUN_LENGTH;
+
+        std::unique_ptr<CompressionSlot> slot(new CompressionSlot());
+        allocate(slot->bitOutBuffers, BIT_BLOCK_MAX_SIZE * parallelBlockCnt);
+        allocate(slot->bitOutCnts, parallelBlockCnt);
+        allocate(slot->blockCRCs, parallelBlockCnt);
+        allocate(slot->isEmptyCompressor, parallelBlockCnt);
+        allocate(slot->inputBlocks, blockStride * parallelBlockCnt);
+        allocate(slot->inputBlockSizes, parallelBlockCnt);
+        allocate(slot->bwtBlocks, blockStride * parallelBlockCnt);
+        allocate(slot->bwtBucketsA, BWT_BUCKET_A_SIZE * parallelBlockCnt);
+        allocate(slot->bwtBucketsB, BWT_BUCKET_B_SIZE * parallelBlockCnt);
+        allocate(slot->bwtTempBuffs, ALPHABET_SIZE * parallelBlockCnt);
+        allocate(slot->blocksValuePresent, ALPHABET_SIZE * parallelBlockCnt);
+        allocate(slot->mtfsSymbolFrequencies, HUFFMAN_MAXIMUM_ALPHABET_SIZE * parallelBlockCnt);
+        allocate(slot->huffmanSymbolMaps, ALPHABET_SIZE * parallelBlockCnt);
+        allocate(slot->symbolMTFs, ALPHABET_SIZE * parallelBlockCnt);
+        allocate(slot->huffmanSelectors, selectorStride * parallelBlockCnt);
+        allocate(slot->huffmanCodeTables, HUFFMAN_MAXIMUM_TABLES * HUFFMAN_MAXIMUM_ALPHABET_SIZE * parallelBlockCnt);
+        allocate(slot->blockStates, BLOCK_STATE_SIZE * parallelBlockCnt);
+
+        slot->assemblyEvents.resize(2);
+        slot->hostBlockSeconds.resize(parallelBlockCnt);
+
+        if (verifyOnHost)
+        {
+            slot->verifyBitOutBuffers = Memory<unsigned char>(BIT_BLOCK_MAX_SIZE * parallelBlockCnt);
+            slot->verifyBitOutCnts = Memory<size_t>(parallelBlockCnt);
+        }
+
+        if (device)
+        {
+            // One work-group per block for BWT, MTF/RLE2, the Huffman tables and the emission of
+            // the block, each with its own size. The host build of kernel_close keeps the serial
+            // stages.
+            slot->bwtRanks = Memory<int>(*device, 2 * blockStride * parallelBlockCnt);
+            slot->kernel_bwt.reset(new Kernel{*device,
+                                              static_cast<ulong>(parallelBlockCnt) * bwtGroupSize,
+                                              bwtGroupSize,
+                                              "kernel_bwt",
+                                              slot->isEmptyCompressor,
+                                              slot->inputBlocks,
+                                              slot->bwtBlocks,
+                                              slot->inputBlockSizes,
+                                              slot->bwtRanks,
+                                              slot->bwtBucketsA,
+                                              slot->bwtBucketsB,
+                                              slot->bwtTempBuffs,
+                                              slot->blockStates,
+                                              parallelBlockCnt,
+                                              streamBlockSize});
+            slot->kernel_mtf.reset(new Kernel{*device,
+                                              static_cast<ulong>(parallelBlockCnt) * mtfGroupSize,
+                                              mtfGroupSize,
+                                              "kernel_mtf",
+                                              slot->isEmptyCompressor,
+                                              slot->bwtBlocks,
+                                              slot->inputBlockSizes,
+                                              slot->blocksValuePresent,
+                                              slot->mtfsSymbolFrequencies,
+                                              slot->huffmanSymbolMaps,
+                                              slot->bwtRanks,
+                                              slot->bwtBucketsA,
+                                              slot->bwtBucketsB,
+                                              slot->bwtTempBuffs,
+                                              slot->blockStates,
+                                              parallelBlockCnt,
+                                              streamBlockSize});
+            slot->kernel_huffman_tables.reset(new Kernel{*device,
+                                                         static_cast<ulong>(parallelBlockCnt) * tablesGroupSize,
+                                                         tablesGroupSize,
+                                                         "kernel_huffman_tables",
+                                                         slot->isEmptyCompressor,
+                                                         slot->bwtBlocks,
+                                                         slot->mtfsSymbolFrequencies,
+                                                         slot->huffmanSelectors,
+                                                         slot->huffmanCodeTables,
+                                                         slot->bwtBucketsB,
+                                                         slot->blockStates,
+                                                         parallelBlockCnt,
+                                                         streamBlockSize});
+            slot->kernel_huffman_emit.reset(new Kernel{*device,
+                                                       static_cast<ulong>(parallelBlockCnt) * emitGroupSize,
+                                                       emitGroupSize,
+                                                       "kernel_huffman_emit",
+                                                       slot->isEmptyCompressor,
+                                                       slot->blockCRCs,
+                                                       slot->bwtBlocks,
+                                                       slot->blocksValuePresent,
+                                                       slot->huffmanSelectors,
+                                                       slot->huffmanCodeTables,
+                                                       slot->bitOutBuffers,
+                                                       slot->bitOutCnts,
+                                                       slot->bwtBucketsA,
+                                                       slot->bwtBucketsB,
+                                                       slot->bwtTempBuffs,
+                                                       slot->blockStates,
+                                                       parallelBlockCnt,
+                                                       streamBlockSize,
+                                                       static_cast<unsigned int>(BIT_BLOCK_MAX_SIZE)});
+
+            // One work item per block, then one per byte of the largest possible batch,
+            // both narrowed to the live blocks on each launch
+            slot->blockBitOffsets = Memory<ulong>(*device, parallelBlockCnt + 1);
+            slot->batchCarry = Memory<uint>(*device, 2);
+            slot->assembledBuffer = Memory<unsigned char>(*device, BIT_BLOCK_MAX_SIZE * parallelBlockCnt + 1);
+            slot->kernel_block_offsets.reset(new Kernel{*device,
+                                                        parallelBlockCnt,
+                                                        "kernel_block_offsets",
+                                                        slot->bitOutCnts,
+                                                        streamCarry,
+                                                        slot->batchCarry,
+                                                        slot->blockBitOffsets,
+                                                        parallelBlockCnt});
+            if (rleOnDevice)
+            {
+                // Starts at the size of the RLE1 blocks, runs can make a batch take more
+                slot->rawInput = Memory<unsigned char>(*device, blockStride * parallelBlockCnt);
+                slot->rawBlockOffsets = Memory<ulong>(*device, parallelBlockCnt + 1);
+                slot->kernel_rle1.reset(new Kernel{*device,
+                                                   parallelBlockCnt,
+                                                   "kernel_rle1",
+                                                   slot->rawInput,
+                                                   slot->rawBlockOffsets,
+                                                   slot->isEmptyCompressor,
+                                                   slot->inputBlocks,
+                                                   slot->inputBlockSizes,
+                                                   slot->blockCRCs,
+                                                   slot->blocksValuePresent,
+                                                   parallelBlockCnt,
+                                                   streamBlockSize});
+            }
+            slot->kernel_assemble_blocks.reset(new Kernel{*device,
+                                                          slot->assembledBuffer.length(),
+                                                          "kernel_assemble_blocks",
+                                                          slot->bitOutBuffers,
+                                                          slot->blockBitOffsets,
+                                                          slot->batchCarry,
+                                                          streamCarry,
+                                                          slot->assembledBuffer,
+                                                          parallelBlockCnt,
+                                                          static_cast<unsigned int>(BIT_BLOCK_MAX_SIZE)});
+        }
+
+        for (int i = 0; i < parallelBlockCnt; ++i)
+        {
+            if (rleOnDevice)
+            {
+                slot->blockCompressors.emplace_back(streamBlockSize);
+            }
+            else
+            {
+                slot->blockCompressors.emplace_back(slot->inputBlocks.data() + i * blockStride,
+                                                    slot->blocksValuePresent.data() + i * ALPHABET_SIZE,
+                                                    streamBlockSize);
+            }
+        }
+
+        return slot;
+    }
+
+    BlockCompressor &currentCompressor()
+    {
+        return slots[slotIdx]->blockCompressors[compressorIdx];
+    }
+
+    void appendRawInput(CompressionSlot &slot, const uint8_t *data, size_t length)
+    {
+        if (slot.rawInputSize + length > slot.rawInput.length())
+        {
+            Memory<unsigned char> rawInput(*device, std::max(slot.rawInput.length() * 2, slot.rawInputSize + length));
+            std::memcpy(rawInput.data(), slot.rawInput.data(), slot.rawInputSize);
+            slot.rawInput = std::move(rawInput);
+            slot.kernel_rle1->set_parameters(0, slot.rawInput);
+        }
+        std::memcpy(slot.rawInput.data() + slot.rawInputSize, data, length);
+        slot.rawInputSize += length;
+    }
+
     void getNextCompressor()
     {
         compressorIdx++;
 
-        if (compressorIdx == blockCompressors.size())
+        if (compressorIdx == parallelBlockCnt)
         {
-            closeBlocks();
+            submitBlocks();
             compressorIdx = 0;
         }
     }
 
-    void closeBlocks()
+    // Queues the compression of the current slot without waiting, then moves on
+    // to the next slot, collecting it first if the device is still working on it.
+    // Block headers are written by kernel_huffman_emit, or kernel_close on the host.
+    void submitBlocks()
+    {
+        if (timings)
+        {
+            timings->record(StageTimings::HostFill, fillClock.stop());
+        }
+
+        auto &slot = *slots[slotIdx];
+        prepareBlocks(slot);
+
+        // A batch without data has nothing to collect
+        if (slot.liveBlockCnt > 0)
+        {
+            if (device)
+            {
+                submitDeviceBlocks(slot);
+            }
+            else
+            {
+                submitHostBlocks(slot);
+            }
+            slot.inFlight = true;
+        }
+
+        slotIdx = (slotIdx + 1) % slots.size();
+        if (slots[slotIdx]->inFlight)
+        {
+            collectBlocks(*slots[slotIdx]);
+        }
+        fillClock.start();
+    }
+
+    // Block lengths, CRCs and empty flags of a filled slot, the live block count
+    // with them. Block CRCs join the stream CRC on collection.
+    void prepareBlocks(CompressionSlot &slot)
     {
-        for (int i = 0; i < blockCompressors.size(); ++i)
+        slot.liveBlockCnt = 0;
+        for (int i = 0; i < slot.blockCompressors.size(); ++i)
         {
-            auto &blockCompressor = blockCompressors[i];
-            isEmptyCompressor[i] = blockCompressor.isEmpty();
+            auto &blockCompressor = slot.blockCompressors[i];
+            slot.isEmptyCompressor[i] = blockCompressor.isEmpty();
+            slot.bitOutCnts[i] = 0UL;
 
-            if (!isEmptyCompressor[i])
+            if (rleOnDevice)
+            {
+                // CRCs come back from kernel_rle1
+                slot.rawBlockOffsets[i + 1] = slot.rawBlockOffsets[i] + blockCompressor.getInputLength();
+                if (!slot.isEmptyCompressor[i])
+                {
+                    slot.liveBlockCnt = i + 1;
+                }
+            }
+            else if (!slot.isEmptyCompressor[i])
             {
                 blockCompressor.finishRLE();
+                slot.blockCRCs[i] = blockCompressor.getCRC();
+                slot.inputBlockSizes[i] = blockCompressor.getBlockLength();
+                slot.liveBlockCnt = i + 1;
+            }
+        }
+    }
+
+    // Fills every block of a trial slot with the sample, repeated as often as
+    // needed. Returns the input bytes the slot holds.
+    size_t fillTrialSlot(CompressionSlot &slot, const uint8_t *sample, size_t length)
+    {
+        size_t inputBytes = 0UL;
+        size_t offset = 0UL;
+        for (auto &blockCompressor : slot.blockCompressors)
+        {
+            size_t available;
+            size_t bytesWritten;
+            do
+            {
+                available = length - offset;
+                bytesWritten = blockCompressor.write(sample + offset, available);
+                if (rleOnDevice)
+                {
+                    appendRawInput(slot, sample + offset, bytesWritten);
+                }
+                inputBytes += bytesWritten;
+                offset = (offset + bytesWritten) % length;
+            } while (bytesWritten == available);
+        }
+        return inputBytes;
+    }
+
+    Event *profilingEvent(Event &event)
+    {
+        return timings ? &event : nullptr;
+    }
+
+    // Fresh profiling event for each host to device transfer of a batch
+    Event *writeEvent(CompressionSlot &slot)
+    {
+        if (!timings)
+        {
+            return nullptr;
+        }
+        slot.writeEvents.emplace_back();
+        return &slot.writeEvents.back();
+    }
+
+    // Only the live blocks are transferred and compressed: inputs up to their
+    // RLE1 length, runs of consecutive blocks in one transfer each
+    void submitDeviceBlocks(CompressionSlot &slot)
+    {
+        const int liveBlockCnt = slot.liveBlockCnt;
+        const size_t blockStride = streamBlockSize + 1;
+
+        slot.writeEvents.clear();
+        slot.isEmptyCompressor.enqueue_write_to_device(0, liveBlockCnt, nullptr, writeEvent(slot));
+        if (rleOnDevice)
+        {
+            // The raw input of the batch is contiguous, one transfer
+            slot.rawBlockOffsets.enqueue_write_to_device(0, liveBlockCnt + 1, nullptr, writeEvent(slot));
+            slot.rawInput.enqueue_write_to_device(0, slot.rawBlockOffsets[liveBlockCnt], nullptr, writeEvent(slot));
+        }
+        else
+        {
+            slot.blockCRCs.enqueue_write_to_device(0, liveBlockCnt, nullptr, writeEvent(slot));
+            slot.inputBlockSizes.enqueue_write_to_device(0, liveBlockCnt, nullptr, writeEvent(slot));
+            for (int first = 0; first < liveBlockCnt;)
+            {
+                if (slot.isEmptyCompressor[first])
+                {
+                    ++first;
+                    continue;
+                }
+
+                int last = first;
+                while (last + 1 < liveBlockCnt && !slot.isEmptyCompressor[last + 1])
+                {
+                    ++last;
+                }
+                slot.inputBlocks.enqueue_write_to_device(first * blockStride, (last - first) * blockStride + slot.inputBlockSizes[last], nullptr, writeEvent(slot));
+                slot.blocksValuePresent.enqueue_write_to_device(first * ALPHABET_SIZE, (last - first + 1) * ALPHABET_SIZE, nullptr, writeEvent(slot));
+                first = last + 1;
+            }
+        }
+
+        size_t expectedBytes = 1UL; // Stream carry
+        for (int i = 0; i < liveBlockCnt; ++i)
+        {
+            if (!slot.isEmptyCompressor[i])
+            {
+                expectedBytes += expectedCompressedBlockSize(blockSizeBound(slot, i));
+            }
+        }
+
+        // blockCnt arguments: 7 of kernel_rle1, 9 of kernel_bwt, 11 of kernel_mtf, 7 of kernel_huffman_tables,
+        // 12 of kernel_huffman_emit, 4 of kernel_block_offsets, 5 of kernel_assemble_blocks
+        if (rleOnDevice)
+        {
+            slot.kernel_rle1->set_ranges(liveBlockCnt).set_parameters(7, liveBlockCnt);
+            slot.kernel_rle1->enqueue_run(1U, nullptr, profilingEvent(slot.rleEvent));
+        }
+        slot.kernel_bwt->set_ranges(static_cast<ulong>(liveBlockCnt) * bwtGroupSize, bwtGroupSize).set_parameters(9, liveBlockCnt);
+        slot.kernel_mtf->set_ranges(static_cast<ulong>(liveBlockCnt) * mtfGroupSize, mtfGroupSize).set_parameters(11, liveBlockCnt);
+        slot.kernel_huffman_tables->set_ranges(static_cast<ulong>(liveBlockCnt) * tablesGroupSize, tablesGroupSize).set_parameters(7, liveBlockCnt);
+        slot.kernel_huffman_emit->set_ranges(static_cast<ulong>(liveBlockCnt) * emitGroupSize, emitGroupSize).set_parameters(12, liveBlockCnt);
+        slot.kernel_block_offsets->set_ranges(liveBlockCnt).set_parameters(4, liveBlockCnt);
+        slot.kernel_assemble_blocks->set_ranges(BIT_BLOCK_MAX_SIZE * liveBlockCnt + 1).set_parameters(5, liveBlockCnt);
+
+        slot.kernel_bwt->enqueue_run(1U, nullptr, profilingEvent(slot.bwtEvent));
+        slot.kernel_mtf->enqueue_run(1U, nullptr, profilingEvent(slot.mtfEvent));
+        slot.kernel_huffman_tables->enqueue_run(1U, nullptr, profilingEvent(slot.tablesEvent));
+        slot.kernel_huffman_emit->enqueue_run(1U, nullptr, profilingEvent(slot.emitEvent));
+        // The in-order queue keeps the stream carry flowing from batch to batch
+        slot.kernel_block_offsets->enqueue_run(1U, nullptr, profilingEvent(slot.assemblyEvents[0]));
+        slot.kernel_assemble_blocks->enqueue_run(1U, nullptr, profilingEvent(slot.assemblyEvents[1]));
+        if (verifyOnHost)
+        {
+            for (int i = 0; i < liveBlockCnt; ++i)
+            {
+                if (!slot.isEmptyCompressor[i])
+                {
+                    slot.bitOutBuffers.enqueue_read_from_device(i * BIT_BLOCK_MAX_SIZE, maxCompressedBlockSize(blockSizeBound(slot, i)));
+                }
+            }
+            slot.bitOutCnts.enqueue_read_from_device(0, liveBlockCnt);
+        }
+        if (rleOnDevice)
+        {
+            slot.blockCRCs.enqueue_read_from_device(0, liveBlockCnt);
+        }
+        slot.assembledReadBytes = std::min<size_t>(slot.assembledBuffer.length(), expectedBytes);
+        slot.assembledBuffer.enqueue_read_from_device(0, slot.assembledReadBytes, nullptr, profilingEvent(slot.readEvent));
+        slot.blockBitOffsets.enqueue_read_from_device(0, liveBlockCnt + 1, nullptr, &slot.transferDone); // In-order queue, last command marks the batch done
+        device->flush_queue();
+    }
+
+    // Execution time of a finished command on a profiling queue
+    static double eventSeconds(const Event &event)
+    {
+        return (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+    }
+
+    // Same work items as the OpenCL launch, each block is a task on the thread pool
+    void submitHostBlocks(CompressionSlot &slot)
+    {
+        for (int i = 0; i < slot.liveBlockCnt; ++i)
+        {
+            if (slot.isEmptyCompressor[i])
+            {
+                continue;
+            }
+
+            CompressionSlot *slotPtr = &slot;
+            slot.blockTasks.push_back(threadPool->enqueue([this, slotPtr, i]
+                                                          { compressHostBlock(*slotPtr, i, slotPtr->bitOutBuffers, slotPtr->bitOutCnts); }));
+        }
+    }
+
+    void compressHostBlock(CompressionSlot &slot, int blockIdx, Memory<unsigned char> &bitOutBuffers, Memory<size_t> &bitOutCnts)
+    {
+        Clock blockClock;
+        host_kernel::globalId = blockIdx;
+        host_kernel::kernel_close(slot.isEmptyCompressor.data(),
+                                  slot.blockCRCs.data(),
+                                  slot.inputBlocks.data(),
+                                  slot.bwtBlocks.data(),
+                                  slot.inputBlockSizes.data(),
+                                  slot.bwtBucketsA.data(),
+                                  slot.bwtBucketsB.data(),
+                                  slot.bwtTempBuffs.data(),
+                                  bitOutBuffers.data(),
+                                  bitOutCnts.data(),
+                                  slot.blocksValuePresent.data(),
+                                  slot.mtfsSymbolFrequencies.data(),
+                                  slot.huffmanSymbolMaps.data(),
+                                  slot.symbolMTFs.data(),
+                                  slot.huffmanSelectors.data(),
+                                  parallelBlockCnt,
+                                  streamBlockSize,
+                                  static_cast<unsigned int>(BIT_BLOCK_MAX_SIZE),
+                                  slot.huffmanCodeTables.data(),
+                                  slot.blockStates.data());
+        slot.hostBlockSeconds[blockIdx] = blockClock.stop();
+    }
 
-                int blockCRC = blockCompressor.getCRC();
-                streamCRC = ((streamCRC << 1) | (static_cast<unsigned int>(streamCRC) >> 31)) ^ blockCRC;
+    // Host build of kernel_rle1 for one block, fills the host side RLE1 buffers
+    void hostBlockRLE(CompressionSlot &slot, int blockIdx)
+    {
+        host_kernel::globalId = blockIdx;
+        host_kernel::kernel_rle1(slot.rawInput.data(),
+                                 slot.rawBlockOffsets.data(),
+                                 slot.isEmptyCompressor.data(),
+                                 slot.inputBlocks.data(),
+                                 slot.inputBlockSizes.data(),
+                                 slot.blockCRCs.data(),
+                                 slot.blocksValuePresent.data(),
+                                 slot.liveBlockCnt,
+                                 streamBlockSize);
+    }
+
+    // Bit position of the BWT start pointer in a compressed block, after the block header
+    static constexpr size_t START_POINTER_BIT = 24 + 24 + 32 + 1;
+
+    static int readStartPointer(const unsigned char *bytes)
+    {
+        int startPointer = 0;
+        for (size_t bit = START_POINTER_BIT; bit < START_POINTER_BIT + 24; ++bit)
+        {
+            startPointer = (startPointer << 1) | ((bytes[bit / 8] >> (7 - bit % 8)) & 1);
+        }
+        return startPointer;
+    }
+
+    // Whether device and host compressed block alike. When block is a shorter string repeated
+    // k times, every rotation has k - 1 equal ones, next to it in sorted order. The start pointer
+    // may be any of the k, kernel_bwt takes the first and DivSufSortBWT one of them.
+    static bool sameCompressedBlock(const unsigned char *deviceBytes, const unsigned char *hostBytes, size_t byteCnt,
+                                    const unsigned char *block, size_t blockLength)
+    {
+        if (std::equal(deviceBytes, deviceBytes + byteCnt, hostBytes))
+        {
+            return true;
+        }
+
+        std::vector<unsigned char> hostCopy(hostBytes, hostBytes + byteCnt);
+        for (size_t bit = START_POINTER_BIT; bit < START_POINTER_BIT + 24; ++bit)
+        {
+            const unsigned char mask = static_cast<unsigned char>(0x80 >> (bit % 8));
+            hostCopy[bit / 8] = static_cast<unsigned char>((hostCopy[bit / 8] & ~mask) | (deviceBytes[bit / 8] & mask));
+        }
+        if (!std::equal(deviceBytes, deviceBytes + byteCnt, hostCopy.begin()))
+        {
+            return false;
+        }
 
-                inputBlockSizes[i] = blockCompressor.getBlockLength();
+        // Shortest period of the block from its longest border, by the KMP failure function
+        std::vector<size_t> border(blockLength, 0);
+        for (size_t i = 1, k = 0; i < blockLength; ++i)
+        {
+            while (k > 0 && block[i] != block[k])
+            {
+                k = border[k - 1];
+            }
+            if (block[i] == block[k])
+            {
+                ++k;
+            }
+            border[i] = k;
+        }
+        const size_t period = blockLength - border[blockLength - 1];
+        const int repeats = blockLength % period == 0 ? static_cast<int>(blockLength / period) : 1;
+        return readStartPointer(deviceBytes) / repeats == readStartPointer(hostBytes) / repeats;
+    }
 
-                bool *bitBuffer = bitOutBuffers.data() + i * 16 * streamBlockSize;
-                size_t *bitCount = &(bitOutCnts[i]);
-                writeBits(bitBuffer, bitCount, 24, BLOCK_HEADER_MARKER_1);
-                writeBits(bitBuffer, bitCount, 24, BLOCK_HEADER_MARKER_2);
-                writeInteger(bitBuffer, bitCount, blockCRC);
-                writeBoolean(bitBuffer, bitCount, false); // Randomised block flag
+    // Compresses the batch again with the host build of the kernel and compares
+    // it with what the device returned, the host buffers still hold the input
+    void verifyBlocks(CompressionSlot &slot)
+    {
+        std::vector<std::future<void>> verifyTasks;
+        for (int i = 0; i < slot.liveBlockCnt; ++i)
+        {
+            if (!slot.isEmptyCompressor[i])
+            {
+                CompressionSlot *slotPtr = &slot;
+                verifyTasks.push_back(threadPool->enqueue([this, slotPtr, i]
+                                                          {
+                                                              if (rleOnDevice)
+                                                              {
+                                                                  hostBlockRLE(*slotPtr, i);
+                                                              }
+                                                              compressHostBlock(*slotPtr, i, slotPtr->verifyBitOutBuffers, slotPtr->verifyBitOutCnts); }));
             }
         }
+        for (auto &verifyTask : verifyTasks)
+        {
+            verifyTask.get();
+        }
 
-        isEmptyCompressor.write_to_device();
-        inputBlocks.write_to_device();
-        inputBlockSizes.write_to_device();
-        bitOutBuffers.write_to_device();
-        bitOutCnts.write_to_device();
-        blocksValuePresent.write_to_device();
-        kernel_close->run();
-        bitOutBuffers.read_from_device();
-        bitOutCnts.read_from_device();
+        const size_t blockStride = streamBlockSize + 1;
+        for (int i = 0; i < slot.liveBlockCnt; ++i)
+        {
+            if (slot.isEmptyCompressor[i])
+            {
+                continue;
+            }
 
-        std::vector<bool> leftBuffer{};
+            const unsigned char *deviceBytes = slot.bitOutBuffers.data() + i * BIT_BLOCK_MAX_SIZE;
+            const unsigned char *hostBytes = slot.verifyBitOutBuffers.data() + i * BIT_BLOCK_MAX_SIZE;
+            if (slot.bitOutCnts[i] != slot.verifyBitOutCnts[i] ||
+                !sameCompressedBlock(deviceBytes, hostBytes, (slot.bitOutCnts[i] + 7) / 8, slot.inputBlocks.data() + i * blockStride, slot.inputBlockSizes[i]))
+            {
+                throw std::runtime_error("Device and host output differ for block " + std::to_string(i) + " of batch");
+            }
+        }
+    }
 
-        for (int i = 0; i < blockCompressors.size(); ++i)
+    void recordBatchTimings(CompressionSlot &slot, double waitSeconds)
+    {
+        timings->record(StageTimings::Wait, waitSeconds);
+
+        if (device)
         {
-            auto &blockCompressor = blockCompressors[i];
-            if (!isEmptyCompressor[i])
+            double writeSeconds = 0.0;
+            for (const Event &writeEvent : slot.writeEvents)
+            {
+                writeSeconds += eventSeconds(writeEvent);
+            }
+            timings->record(StageTimings::HostToDevice, writeSeconds);
+            if (rleOnDevice)
             {
-                writeFileBytes(bitOutBuffers.data() + i * BIT_BLOCK_MAX_SIZE, &(bitOutCnts[i]), outputStream, leftBuffer);
-                leftBuffer = getLeftBuffer(bitOutBuffers.data() + i * BIT_BLOCK_MAX_SIZE, &(bitOutCnts[i]));
+                timings->record(StageTimings::DeviceRLE, eventSeconds(slot.rleEvent));
+            }
+            timings->record(StageTimings::DeviceBWT, eventSeconds(slot.bwtEvent));
+            timings->record(StageTimings::DeviceMTF, eventSeconds(slot.mtfEvent));
+            timings->record(StageTimings::DeviceTables, eventSeconds(slot.tablesEvent));
+            timings->record(StageTimings::DeviceEmit, eventSeconds(slot.emitEvent));
+            double assemblySeconds = 0.0;
+            for (const Event &assemblyEvent : slot.assemblyEvents)
+            {
+                assemblySeconds += eventSeconds(assemblyEvent);
+            }
+            timings->record(StageTimings::Assembly, assemblySeconds);
+            timings->record(StageTimings::DeviceToHost, eventSeconds(slot.readEvent) + eventSeconds(slot.transferDone));
+        }
+        else
+        {
+            double kernelSeconds = 0.0;
+            for (int i = 0; i < slot.liveBlockCnt; ++i)
+            {
+                if (!slot.isEmptyCompressor[i])
+                {
+                    kernelSeconds += slot.hostBlockSeconds[i];
+                }
+            }
+            timings->record(StageTimings::Kernel, kernelSeconds);
+        }
+    }
+
+    // Waits for a submitted slot and packs its blocks into the output stream
+    void collectBlocks(CompressionSlot &slot)
+    {
+        Clock waitClock;
+        if (device)
+        {
+            slot.transferDone.wait();
+        }
+        for (auto &blockTask : slot.blockTasks)
+        {
+            blockTask.get();
+        }
+        slot.blockTasks.clear();
+
+        if (timings)
+        {
+            recordBatchTimings(slot, waitClock.stop());
+        }
+        Clock packingClock;
+
+        // Batches are collected in stream order
+        for (int i = 0; i < slot.liveBlockCnt; ++i)
+        {
+            if (!slot.isEmptyCompressor[i])
+            {
+                streamCRC = CRC32::combineStreamCRC(streamCRC, slot.blockCRCs[i]);
+            }
+        }
+        if (rleOnDevice)
+        {
+            slot.rawInputSize = 0UL;
+        }
+
+        if (verifyOnHost)
+        {
+            verifyBlocks(slot);
+        }
+
+        if (device)
+        {
+            // Already joined by kernel_assemble_blocks, whole bytes only
+            const size_t assembledBytes = slot.blockBitOffsets[slot.liveBlockCnt] >> 3;
+            if (assembledBytes > slot.assembledReadBytes)
+            {
+                slot.assembledBuffer.read_from_device(slot.assembledReadBytes, assembledBytes - slot.assembledReadBytes);
+            }
+            bitStitcher.append(slot.assembledBuffer.data(), assembledBytes << 3);
+        }
+        for (int i = 0; i < slot.blockCompressors.size(); ++i)
+        {
+            auto &blockCompressor = slot.blockCompressors[i];
+            if (!device && !slot.isEmptyCompressor[i])
+            {
+                bitStitcher.append(slot.bitOutBuffers.data() + i * BIT_BLOCK_MAX_SIZE, slot.bitOutCnts[i]);
             }
             blockCompressor.reset();
         }
+        bitStitcher.flush(outputStream);
+
+        if (timings)
+        {
+            timings->record(StageTimings::BitPacking, packingClock.stop());
+        }
 
-        // Leftover is written in the next iteration
-        writeFileBytes(bitOutBuffers.data(), &(bitOutCnts[0]), outputStream, leftBuffer);
+        // Leftover is written with the next batch
+        slot.inFlight = false;
     }
 };
 #endif
\ No newline at end of file
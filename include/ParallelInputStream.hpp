@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2024 Stanislav Brega
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef PARALLEL_INPUT_STREAM_HPP
+#define PARALLEL_INPUT_STREAM_HPP
+
+#include <istream>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <future>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <exception>
+
+#include "Config.hpp"
+#include "BitInputStream.hpp"
+#include "BlockDecompressor.hpp"
+#include "ThreadPool.hpp"
+
+// Decompresses a BZip2 stream with one thread pool task per block. Blocks are
+// found by scanning for the block header marker at any bit offset, decoded
+// concurrently and returned in stream order. Input is read front to back in
+// chunks, so non-seekable streams work and memory stays bounded by the
+// look-ahead of at most lookAheadBlocks blocks.
+class ParallelInputStream
+{
+private:
+    static constexpr uint64_t BLOCK_HEADER_MARKER = (static_cast<uint64_t>(BLOCK_HEADER_MARKER_1) << 24) | BLOCK_HEADER_MARKER_2;
+    static constexpr uint64_t STREAM_END_MARKER = (static_cast<uint64_t>(STREAM_END_MARKER_1) << 24) | STREAM_END_MARKER_2;
+    static constexpr uint64_t MARKER_MASK = (1ULL << 48) - 1ULL;
+    static constexpr size_t READ_CHUNK_SIZE = 1 << 16;
+    static constexpr size_t NO_BLOCK = SIZE_MAX;
+
+    struct DecodedBlock
+    {
+        std::vector<uint8_t> data{};
+        int crc = 0;
+    };
+
+    struct BlockJob
+    {
+        std::vector<uint8_t> segment{}; // Bytes holding the block, starting with its marker
+        int skipBits = 0;               // Bits before the block header in the first byte, marker included
+        size_t endByte = 0;             // Byte of the segment where the next marker starts
+        bool endsStream = false;        // The next marker is the end of stream marker
+        std::shared_ptr<DecodedBlock> block{};
+        std::future<void> decoded{};
+    };
+
+    std::istream &inputStream;
+    bool headerRead = false;
+    bool endMarkerFound = false;
+    bool streamComplete = false;
+    int streamBlockSize{};
+    int streamCRC = 0;
+    int storedCRC = 0;
+    size_t lookAheadBlocks;
+
+    std::vector<uint8_t> window{}; // Unconsumed input, from the start of the block being scanned
+    size_t blockStartBit = NO_BLOCK;
+    size_t scanBit = 0;
+    uint64_t scanRegister = 0U;
+    size_t scanRegisterBits = 0;
+
+    std::deque<BlockJob> jobs{};
+    DecodedBlock currentBlock{};
+    size_t currentPosition = 0;
+    std::unique_ptr<ThreadPool> threadPool; // Destroyed first, tasks own their data
+
+public:
+    explicit ParallelInputStream(std::istream &in, int threadCnt = 0, int lookAheadBlocks = 0) : inputStream(in)
+    {
+        if (threadCnt < 0)
+        {
+            throw std::invalid_argument("Invalid thread count");
+        }
+
+        if (lookAheadBlocks < 0)
+        {
+            throw std::invalid_argument("Invalid look-ahead block count");
+        }
+
+        // All hardware threads by default
+        threadPool.reset(new ThreadPool(threadCnt ? threadCnt : std::max(1U, std::thread::hardware_concurrency())));
+        this->lookAheadBlocks = lookAheadBlocks ? lookAheadBlocks : 2 * threadPool->size();
+    }
+
+    int read()
+    {
+        if (!nextBytesAvailable())
+        {
+            return -1;
+        }
+        return currentBlock.data[currentPosition++];
+    }
+
+    int read(std::vector<uint8_t> &buffer, int offset, int length)
+    {
+        return read(buffer.data() + offset, static_cast<size_t>(length));
+    }
+
+    // Fills the buffer across block boundaries, -1 at the end of the stream
+    int read(uint8_t *buffer, size_t length)
+    {
+        length = std::min<size_t>(length, INT_MAX);
+        size_t bytesRead = 0;
+        while (bytesRead < length && nextBytesAvailable())
+        {
+            const size_t count = std::min(length - bytesRead, currentBlock.data.size() - currentPosition);
+            std::memcpy(buffer + bytesRead, currentBlock.data.data() + currentPosition, count);
+            currentPosition += count;
+            bytesRead += count;
+        }
+        return (bytesRead == 0 && length > 0) ? -1 : static_cast<int>(bytesRead);
+    }
+
+    void close()
+    {
+        streamComplete = true;
+        jobs.clear(); // Running tasks own their data
+        currentBlock = DecodedBlock();
+        currentPosition = 0;
+    }
+
+private:
+    bool nextBytesAvailable()
+    {
+        while (currentPosition == currentBlock.data.size())
+        {
+            if (!initializeNextBlock())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool initializeNextBlock()
+    {
+        if (streamComplete)
+        {
+            return false;
+        }
+        if (!headerRead)
+        {
+            initializeStream();
+        }
+
+        submitBlocks();
+        if (jobs.empty())
+        {
+            streamComplete = true;
+            if (storedCRC != streamCRC)
+            {
+                throw std::runtime_error("BZip2 stream CRC error");
+            }
+            return false;
+        }
+
+        currentBlock = std::move(*collectBlock());
+        currentPosition = 0;
+        streamCRC = CRC32::combineStreamCRC(streamCRC, currentBlock.crc);
+
+        // Keep the pool busy while the caller consumes this block
+        submitBlocks();
+        return true;
+    }
+
+    void initializeStream()
+    {
+        while (window.size() < 4)
+        {
+            if (!readChunk())
+            {
+                throw std::runtime_error("Insufficient data");
+            }
+        }
+
+        int marker1 = static_cast<int>(bitsAt(0, 16));
+        int marker2 = static_cast<int>(bitsAt(16, 8));
+        int blockSize = static_cast<int>(bitsAt(24, 8)) - '0';
+
+        if (marker1 != STREAM_START_MARKER_1 ||
+            marker2 != STREAM_START_MARKER_2 ||
+            blockSize < 1 || blockSize > 9)
+        {
+            throw std::runtime_error("Invalid BZip2 header");
+        }
+
+        streamBlockSize = blockSize * BLOCKSIZE_DEFAULT;
+        scanBit = 32;
+        headerRead = true;
+    }
+
+    // Scans ahead until the look-ahead is full or the end of stream marker is found
+    void submitBlocks()
+    {
+        while (jobs.size() < lookAheadBlocks && !endMarkerFound)
+        {
+            size_t markerBit;
+            bool endMarker;
+            while (!findMarker(markerBit, endMarker))
+            {
+                if (!readChunk())
+                {
+                    throw std::runtime_error("Insufficient data");
+                }
+            }
+
+            if (blockStartBit != NO_BLOCK)
+            {
+                submitBlock(markerBit, endMarker);
+            }
+
+            // Everything before the new marker is consumed
+            const size_t consumedBytes = markerBit / 8;
+            window.erase(window.begin(), window.begin() + consumedBytes);
+            markerBit -= consumedBytes * 8;
+            scanBit -= consumedBytes * 8;
+            blockStartBit = markerBit;
+
+            if (endMarker)
+            {
+                while (window.size() * 8 < markerBit + 48 + 32)
+                {
+                    if (!readChunk())
+                    {
+                        throw std::runtime_error("Insufficient data");
+                    }
+                }
+                storedCRC = static_cast<int>(bitsAt(markerBit + 48, 32));
+                endMarkerFound = true;
+            }
+        }
+    }
+
+    void submitBlock(size_t endBit, bool endsStream)
+    {
+        jobs.emplace_back();
+        BlockJob &job = jobs.back();
+        job.endsStream = endsStream;
+        const size_t firstByte = blockStartBit / 8;
+        job.segment.assign(window.begin() + firstByte, window.begin() + (endBit + 7) / 8);
+        job.skipBits = static_cast<int>(blockStartBit % 8) + 48;
+        job.endByte = endBit / 8 - firstByte;
+        job.block = std::make_shared<DecodedBlock>();
+
+        // The task keeps its own references, a closed stream may drop the job early
+        auto segment = std::make_shared<std::vector<uint8_t>>(job.segment);
+        auto block = job.block;
+        const int skipBits = job.skipBits;
+        const int blockSize = streamBlockSize;
+        job.decoded = threadPool->enqueue([segment, block, skipBits, blockSize]
+                                          { decodeBlock(*segment, skipBits, blockSize, *block); });
+    }
+
+    std::shared_ptr<DecodedBlock> collectBlock()
+    {
+        BlockJob job = std::move(jobs.front());
+        jobs.pop_front();
+
+        std::exception_ptr decodeError;
+        try
+        {
+            job.decoded.get();
+            return job.block;
+        }
+        catch (const std::exception &)
+        {
+            decodeError = std::current_exception();
+        }
+
+        // The marker pattern can also occur inside compressed data, which cuts a block
+        // short. Decode it again together with the following segments, up to the
+        // largest size a block can have, before giving up. The same goes for the end of
+        // stream marker, it is only final once the block before it decodes.
+        std::vector<uint8_t> merged(job.segment);
+        size_t mergedEndByte = job.endByte;
+        bool mergedEndsStream = job.endsStream;
+        while (merged.size() <= maxBlockBytes())
+        {
+            if (mergedEndsStream)
+            {
+                endMarkerFound = false;
+            }
+            try
+            {
+                submitBlocks();
+            }
+            catch (const std::exception &)
+            {
+                break;
+            }
+            if (jobs.empty())
+            {
+                break;
+            }
+
+            BlockJob next = std::move(jobs.front());
+            jobs.pop_front();
+            merged.resize(mergedEndByte);
+            merged.insert(merged.end(), next.segment.begin(), next.segment.end());
+            mergedEndByte += next.endByte;
+            mergedEndsStream = next.endsStream;
+
+            auto block = std::make_shared<DecodedBlock>();
+            try
+            {
+                decodeBlock(merged, job.skipBits, streamBlockSize, *block);
+                return block;
+            }
+            catch (const std::exception &)
+            {
+            }
+        }
+        std::rethrow_exception(decodeError);
+    }
+
+    // Block data in codes of at most 20 bits, plus selectors, tables and headers
+    size_t maxBlockBytes() const
+    {
+        return HUFFMAN_ENCODE_MAXIMUM_CODE_LENGTH * (static_cast<size_t>(streamBlockSize) + 1) / 8 + 16384;
+    }
+
+    static void decodeBlock(const std::vector<uint8_t> &segment, int skipBits, int blockSize, DecodedBlock &block)
+    {
+        BitInputStream bitInputStream(segment.data(), segment.size());
+        while (skipBits > 0)
+        {
+            const int bits = std::min(skipBits, 32);
+            bitInputStream.readBits(bits);
+            skipBits -= bits;
+        }
+
+        BlockDecompressor blockDecompressor(bitInputStream, blockSize);
+        size_t length = 0;
+        int bytesRead;
+        do
+        {
+            if (block.data.size() - length < static_cast<size_t>(blockSize))
+            {
+                block.data.resize(length + 2 * blockSize);
+            }
+            bytesRead = blockDecompressor.read(block.data.data() + length, block.data.size() - length);
+            length += bytesRead > 0 ? bytesRead : 0;
+        } while (bytesRead != -1);
+        block.data.resize(length);
+        block.crc = blockDecompressor.checkCRC();
+    }
+
+    // Continues the bit by bit scan of the window, markerBit is where a marker starts
+    bool findMarker(size_t &markerBit, bool &endMarker)
+    {
+        const size_t windowBits = window.size() * 8;
+        while (scanBit < windowBits)
+        {
+            scanRegister = (scanRegister << 1) | ((window[scanBit / 8] >> (7 - scanBit % 8)) & 1U);
+            ++scanBit;
+            if (++scanRegisterBits >= 48)
+            {
+                const uint64_t pattern = scanRegister & MARKER_MASK;
+                if (pattern == BLOCK_HEADER_MARKER || pattern == STREAM_END_MARKER)
+                {
+                    markerBit = scanBit - 48;
+                    endMarker = pattern == STREAM_END_MARKER;
+                    scanRegisterBits = 0;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool readChunk()
+    {
+        const size_t size = window.size();
+        window.resize(size + READ_CHUNK_SIZE);
+        inputStream.read(reinterpret_cast<char *>(window.data() + size), READ_CHUNK_SIZE);
+        window.resize(size + static_cast<size_t>(inputStream.gcount()));
+        return window.size() > size;
+    }
+
+    uint32_t bitsAt(size_t bit, int count) const
+    {
+        uint32_t bits = 0U;
+        for (int i = 0; i < count; ++i, ++bit)
+        {
+            bits = (bits << 1) | ((window[bit / 8] >> (7 - bit % 8)) & 1U);
+        }
+        return bits;
+    }
+};
+#endif
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2024 Stanislav Brega
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef STAGE_TIMINGS_HPP
+#define STAGE_TIMINGS_HPP
+
+#include <ostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+
+// Per-batch wall times of the compression pipeline stages, reported as totals
+// and a log2 histogram of the batch times for every stage
+class StageTimings
+{
+public:
+    enum Stage
+    {
+        HostFill,     // RLE1 + CRC in BlockCompressor::write, includes the caller between batches
+        HostToDevice, // Sum of the buffer writes of a batch
+        DeviceRLE,    // kernel_rle1, only with RLE1 on the device
+        DeviceBWT,    // kernel_bwt
+        DeviceMTF,    // kernel_mtf
+        DeviceTables, // kernel_huffman_tables
+        DeviceEmit,   // kernel_huffman_emit
+        Assembly,     // kernel_block_offsets and kernel_assemble_blocks
+        Kernel,       // kernel_close summed over blocks, CPU backend only
+        DeviceToHost, // Sum of the buffer reads of a batch
+        Wait,         // Host blocked on a batch that was still in flight
+        BitPacking,   // Joining the blocks of a batch and writing them out
+        STAGE_COUNT
+    };
+
+private:
+    std::vector<double> samples[STAGE_COUNT];
+
+    static const char *stageName(int stage)
+    {
+        static const char *names[STAGE_COUNT] = {"host RLE1/CRC", "host to device", "kernel_rle1", "kernel_bwt", "kernel_mtf",
+                                                 "kernel_huffman_tables", "kernel_huffman_emit", "batch assembly", "kernel_close",
+                                                 "device to host", "wait", "bit packing"};
+        return names[stage];
+    }
+
+public:
+    void record(Stage stage, double seconds)
+    {
+        samples[stage].push_back(seconds);
+    }
+
+    void report(std::ostream &out) const
+    {
+        out << "\n  Stage timings (seconds)\n";
+        out << "  " << std::left << std::setw(22) << "stage" << std::right << std::setw(9) << "batches"
+            << std::setw(12) << "total" << std::setw(12) << "mean" << std::setw(12) << "min" << std::setw(12) << "max" << '\n';
+
+        for (int stage = 0; stage < STAGE_COUNT; ++stage)
+        {
+            const std::vector<double> &times = samples[stage];
+            if (times.empty())
+            {
+                continue;
+            }
+
+            double total = 0.0;
+            for (double time : times)
+            {
+                total += time;
+            }
+            out << "  " << std::left << std::setw(22) << stageName(stage) << std::right << std::setw(9) << times.size()
+                << std::fixed << std::setprecision(6)
+                << std::setw(12) << total
+                << std::setw(12) << total / times.size()
+                << std::setw(12) << *std::min_element(times.begin(), times.end())
+                << std::setw(12) << *std::max_element(times.begin(), times.end()) << '\n';
+            out.unsetf(std::ios::floatfield);
+        }
+
+        for (int stage = 0; stage < STAGE_COUNT; ++stage)
+        {
+            if (!samples[stage].empty())
+            {
+                reportHistogram(out, stage);
+            }
+        }
+    }
+
+private:
+    // Bucket k holds batches that took [2^k, 2^(k+1)) microseconds
+    void reportHistogram(std::ostream &out, int stage) const
+    {
+        const int BUCKET_CNT = 40;
+        const int BAR_WIDTH = 40;
+        int buckets[BUCKET_CNT] = {0};
+        int firstBucket = BUCKET_CNT;
+        int lastBucket = 0;
+
+        for (double time : samples[stage])
+        {
+            const double microseconds = time * 1e6;
+            int bucket = microseconds < 1.0 ? 0 : std::min(BUCKET_CNT - 1, static_cast<int>(std::log2(microseconds)));
+            ++buckets[bucket];
+            firstBucket = std::min(firstBucket, bucket);
+            lastBucket = std::max(lastBucket, bucket);
+        }
+        const int mostBatches = *std::max_element(buckets, buckets + BUCKET_CNT);
+
+        out << "\n  " << stageName(stage) << " per batch\n";
+        for (int bucket = firstBucket; bucket <= lastBucket; ++bucket)
+        {
+            out << "  " << std::setw(10) << (1ULL << bucket) << " us " << std::setw(6) << buckets[bucket] << ' '
+                << std::string(buckets[bucket] * BAR_WIDTH / mostBatches, '#') << '\n';
+        }
+    }
+};
+#endif
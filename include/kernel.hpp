@@ -1,7 +1,30 @@
 #pragma once
 
 #include "utilities.hpp"
+
+#ifdef KERNEL_HOST // kernel.cpp compiled as plain C++ for the host backend, see kernel_host.cpp
+#include "HostKernel.hpp"
+#define R(...) __VA_ARGS__
+#define OPENCL_C_BEGIN namespace host_kernel {
+#define OPENCL_C_NEXT
+#define OPENCL_C_END }
+
+#define get_global_id(x) host_kernel::globalId // set by the caller for each block
+#define get_local_id(x) host_kernel::localId
+#define get_local_size(x) host_kernel::localSize
+#define get_group_id(x) host_kernel::groupId
+#define barrier(x) host_kernel::groupBarrier()
+#define CLK_LOCAL_MEM_FENCE
+#define CLK_GLOBAL_MEM_FENCE
+#define kernel
+#define constant const
+#define global
+#define local
+#else // KERNEL_HOST
 #define R(...) string(" "#__VA_ARGS__" ") // evil stringification macro, similar syntax to raw string R"(...)"
+#define OPENCL_C_BEGIN string opencl_c_container() { return
+#define OPENCL_C_NEXT +
+#define OPENCL_C_END ; }
 
 string opencl_c_container(); // outsourced to kernel.cpp
 string get_opencl_c_code() {
@@ -287,4 +310,5 @@ string get_opencl_c_code() {
 #define as_ulong3(x)
 #define as_ulong4(x)
 #define as_ulong8(x)
-#define as_ulong16(x)
\ No newline at end of file
+#define as_ulong16(x)
+#endif // KERNEL_HOST
@@ -105,7 +105,7 @@ inline void print_device_info(const Device_Info& d) { // print OpenCL device inf
 	println("| Buffer Limits  | "+alignl(58, to_string(d.max_global_buffer)+" MB global, "+to_string(d.max_constant_buffer)+" KB constant")+" |");
 	println("|----------------'------------------------------------------------------------|");
 }
-inline vector<Device_Info> get_devices(const bool print_info=true) { // returns a vector of all available OpenCL devices
+inline vector<Device_Info> get_devices(const bool print_info=true, const bool exit_on_error=true) { // returns a vector of all available OpenCL devices, may be empty if exit_on_error=false
 	vector<Device_Info> devices; // get all devices of all platforms
 	vector<cl::Platform> cl_platforms; // get all platforms (drivers)
 	cl::Platform::get(&cl_platforms);
@@ -119,7 +119,7 @@ inline vector<Device_Info> get_devices(const bool print_info=true) { // returns
 			devices.push_back(Device_Info(cl_devices[j], cl_context, id++));
 		}
 	}
-	if((uint)cl_platforms.size()==0u||(uint)devices.size()==0u) {
+	if(((uint)cl_platforms.size()==0u||(uint)devices.size()==0u)&&exit_on_error) {
 		print_error("There are no OpenCL devices available. Make sure that the OpenCL 1.2 Runtime for your device is installed. For GPUs it comes by default with the graphics driver, for CPUs it has to be installed separately.");
 	}
 	if(print_info) {
@@ -180,7 +180,7 @@ private:
 	;}
 public:
 	Device_Info info;
-	inline Device(const Device_Info& info, const string& opencl_c_code=get_opencl_c_code()) {
+	inline Device(const Device_Info& info, const string& opencl_c_code=get_opencl_c_code(), const bool exit_on_error=true) { // with exit_on_error=false a failed build leaves the Device uninitialized
 		print_device_info(info);
 		this->info = info;
 		this->cl_queue = cl::CommandQueue(info.cl_context, info.cl_device); // queue to push commands for the device
@@ -198,6 +198,10 @@ public:
 		write_file("bin/kernel.log", log); // save build log
 		if((uint)log.length()>2u) print_warning(log); // print build log
 #endif // LOG
+		if(error&&!exit_on_error) {
+			print_warning("OpenCL C code compilation failed with error code "+to_string(error)+".");
+			return;
+		}
 		if(error) print_error("OpenCL C code compilation failed with error code "+to_string(error)+". Make sure there are no errors in kernel.cpp.");
 		else print_info("OpenCL C code successfully compiled.");
 #ifdef PTX // generate assembly (ptx) file for OpenCL code
@@ -208,8 +212,12 @@ public:
 	inline Device() {} // default constructor
 	inline void barrier(const vector<Event>* event_waitlist=nullptr, Event* event_returned=nullptr) { cl_queue.enqueueBarrierWithWaitList(event_waitlist, event_returned); }
 	inline void finish_queue() { cl_queue.finish(); }
+	inline void flush_queue() { cl_queue.flush(); }
+	inline void enable_profiling() { cl_queue = cl::CommandQueue(info.cl_context, info.cl_device, CL_QUEUE_PROFILING_ENABLE); } // call before creating any Memory or Kernel on this Device, they keep a copy of the queue
 	inline cl::Context get_cl_context() const { return info.cl_context; }
 	inline cl::Program get_cl_program() const { return cl_program; }
+	inline uint get_max_workgroup_size(const string& kernel_name) const { return (uint)cl::Kernel(cl_program, kernel_name.c_str()).getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(info.cl_device); } // largest work-group the kernel can be launched with on this device
+	inline uint get_preferred_workgroup_multiple(const string& kernel_name) const { return (uint)cl::Kernel(cl_program, kernel_name.c_str()).getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(info.cl_device); } // warp/wavefront width the kernel was compiled for
 	inline cl::CommandQueue get_cl_queue() const { return cl_queue; }
 	inline bool is_initialized() const { return exists; }
 };
@@ -272,6 +280,15 @@ public:
 		external_host_buffer = true;
 		write_to_device();
 	}
+	inline Memory(const ulong N, const uint dimensions=1u, const T value=(T)0) { // host only buffer, no linked Device, transfers are no-ops
+		if(N*(ulong)dimensions==0ull) print_error("Memory size must be larger than 0.");
+		this->N = N;
+		this->d = dimensions;
+		host_buffer = new T[N*(ulong)d];
+		initialize_auxiliary_pointers();
+		host_buffer_exists = true;
+		reset(value);
+	}
 	inline Memory() {} // default constructor
 	inline ~Memory() {
 		delete_buffers();
@@ -281,7 +298,7 @@ public:
 		N = memory.length(); // copy values/pointers from memory
 		d = memory.dimensions();
 		device = memory.device;
-		cl_queue = memory.device->get_cl_queue();
+		if(device) cl_queue = device->get_cl_queue();
 		if(memory.device_buffer_exists) {
 			device_buffer = memory.get_cl_buffer(); // transfer device_buffer pointer
 			device->info.memory_used += (uint)(capacity()/1048576ull); // track device memory usage
@@ -24,9 +24,7 @@
 
 #include "include/kernel.hpp"
 
-string opencl_c_container()
-{
-	return R( // ########################## begin of OpenCL C code ####################################################################
+OPENCL_C_BEGIN R( // ########################## begin of OpenCL C code ####################################################################
 
 			   constant int BLOCK_HEADER_MARKER_1 = 0x314159;
 			   constant int BLOCK_HEADER_MARKER_2 = 0x265359;
@@ -42,7 +40,12 @@ string opencl_c_container()
 			   constant int HUFFMAN_MAXIMUM_TABLES = 6;
 			   constant int HUFFMAN_MAXIMUM_SELECTORS = (MAX_BLOCK_SIZE / HUFFMAN_GROUP_RUN_LENGTH) + 1;
 			   constant int HUFFMAN_SYMBOL_RUNA = 0;
-			   constant int HUFFMAN_SYMBOL_RUNB = 1;) +
+			   constant int HUFFMAN_SYMBOL_RUNB = 1;
+			   // Per block results handed from one stage to the next
+			   constant int BLOCK_STATE_BWT_START_POINTER = 0;
+			   constant int BLOCK_STATE_MTF_LENGTH = 1;
+			   constant int BLOCK_STATE_MTF_ALPHABET_SIZE = 2;
+			   constant int BLOCK_STATE_SIZE = 4;) OPENCL_C_NEXT
 		   R(/* BWT part */
 			 constant int STACK_SIZE = 64;
 			 constant int BUCKET_A_SIZE = 256;
@@ -659,7 +662,7 @@ string opencl_c_container()
 						 } while (SA[k] < 0);
 					 }
 				 }
-			 }) +
+			 }) OPENCL_C_NEXT
 		   R(
 			   void ssMergeBackward(global unsigned char *T, global int *SA, int n, int PA, global int *buf, int bufoffset, int first, int middle, int last, int depth) {
 				   int p1, p2;
@@ -1109,7 +1112,7 @@ string opencl_c_container()
 			   int trLog(int n) {
 				   return ((n & 0xffff0000) != 0) ? (((n & 0xff000000) != 0) ? 24 + log2table[(n >> 24) & 0xff] : 16 + log2table[(n >> 16) & 0xff])
 												  : (((n & 0x0000ff00) != 0) ? 8 + log2table[(n >> 8) & 0xff] : 0 + log2table[(n >> 0) & 0xff]);
-			   }) +
+			   }) OPENCL_C_NEXT
 		   R(
 			   int trMedian3(global unsigned char *T, global int *SA, int n, int ISA, int ISAd, int ISAn, int v1, int v2, int v3) {
 				   int SA_v1 = trGetC(T, SA, n, ISA, ISAd, ISAn, SA[v1]);
@@ -1653,7 +1656,7 @@ string opencl_c_container()
 				   return true;
 			   }
 
-			   void trIntroSort(global unsigned char *T, global int *SA, int n, int ISA, int ISAd, int ISAn, int first, int last, struct TRBudget budget, int size) {
+			   void trIntroSort(global unsigned char *T, global int *SA, int n, int ISA, int ISAd, int ISAn, int first, int last, struct TRBudget *budget, int size) {
 				   struct StackEntry stack[STACK_SIZE] = {{0, 0, 0, 0}};
 
 				   int a, b, c, d, e, f;
@@ -1668,7 +1671,7 @@ string opencl_c_container()
 					   {
 						   if (limit == -1)
 						   {
-							   if (!updateTRBudget(&budget, size, last - first))
+							   if (!updateTRBudget(budget, size, last - first))
 								   break;
 							   struct PartitionResult result = trPartition(T, SA, n, ISA, ISAd - 1, ISAn, first, last, last - 1);
 							   a = result.first;
@@ -1835,7 +1838,7 @@ string opencl_c_container()
 
 					   if ((last - first) <= INSERTIONSORT_THRESHOLD)
 					   {
-						   if (!updateTRBudget(&budget, size, last - first))
+						   if (!updateTRBudget(budget, size, last - first))
 							   break;
 						   trInsertionSort(T, SA, n, ISA, ISAd, ISAn, first, last);
 						   limit = -3;
@@ -1844,7 +1847,7 @@ string opencl_c_container()
 
 					   if (limit-- == 0)
 					   {
-						   if (!updateTRBudget(&budget, size, last - first))
+						   if (!updateTRBudget(budget, size, last - first))
 							   break;
 						   trHeapSort(T, SA, n, ISA, ISAd, ISAn, first, last - first);
 						   for (a = last - 1; first < a; a = b)
@@ -2090,7 +2093,7 @@ string opencl_c_container()
 					   }
 					   else
 					   {
-						   if (!updateTRBudget(&budget, size, last - first))
+						   if (!updateTRBudget(budget, size, last - first))
 							   break; // BUGFIX : Added to prevent an infinite loop in the original code
 						   limit += 1;
 						   ISAd += 1;
@@ -2104,7 +2107,7 @@ string opencl_c_container()
 						   lsUpdateGroup(T, SA, n, ISA, stack[s].b, stack[s].c);
 					   }
 				   }
-			   }) +
+			   }) OPENCL_C_NEXT
 		   R(
 			   void trSort(global unsigned char *T, global int *SA, int ISA, int n, int depth) {
 				   int first = 0, last;
@@ -2124,7 +2127,7 @@ string opencl_c_container()
 							   last = SA[ISA + t] + 1;
 							   if (1 < (last - first))
 							   {
-								   trIntroSort(T, SA, n, ISA, ISA + depth, ISA + n, first, last, budget, n);
+								   trIntroSort(T, SA, n, ISA, ISA + depth, ISA + n, first, last, &budget, n);
 								   if (budget.chance == 0)
 								   {
 									   if (0 < first)
@@ -2424,7 +2427,7 @@ string opencl_c_container()
 				   }
 
 				   return orig;
-			   }) +
+			   }) OPENCL_C_NEXT
 		   R(
 			   int DivSufSortBWT(global unsigned char *T, global int *SA, global int *bucketA, global int *bucketB, global int *tempbuf, int n) {
 				   if (n == 0)
@@ -2452,35 +2455,308 @@ string opencl_c_container()
 					   return constructBWT(T, SA, n, bucketA, bucketB);
 				   }
 
+				   // No B* rotation, the block is one symbol repeated
+				   for (int i = 0; i < n; ++i)
+				   {
+					   SA[i] = T[i];
+				   }
 				   return 0;
+			   }) OPENCL_C_NEXT
+		   R(/* Cooperative BWT, the whole work-group sorts one block */
+
+			   // Chunk of [0, length) owned by the calling work item, in work item order
+			   int chunkStart(int length) {
+				   return length * (int)get_local_id(0) / (int)get_local_size(0);
+			   }
+
+			   int chunkEnd(int length) {
+				   return length * ((int)get_local_id(0) + 1) / (int)get_local_size(0);
+			   }
+
+			   // Exclusive prefix sum of values by the work-group, partials holds one sum per work item
+			   void groupExclusiveScan(global int *values, int length, global int *partials) {
+				   const int localId = get_local_id(0);
+				   const int start = chunkStart(length);
+				   const int end = chunkEnd(length);
+
+				   int sum = 0;
+				   for (int j = start; j < end; ++j)
+				   {
+					   sum += values[j];
+				   }
+				   partials[localId] = sum;
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+
+				   // Few work items, each sums its predecessors directly
+				   int offset = 0;
+				   for (int u = 0; u < localId; ++u)
+				   {
+					   offset += partials[u];
+				   }
+				   for (int j = start; j < end; ++j)
+				   {
+					   const int value = values[j];
+					   values[j] = offset;
+					   offset += value;
+				   }
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+			   }
+
+			   // Stable LSD radix pass over one byte of the rank of each rotation in src. Every work
+			   // item counts its own chunk, counts are laid out digit-major (digit * local size + work
+			   // item) so that one scan turns them into scatter positions that keep the chunk order.
+			   void bwtRadixPass(global int *rank, global int *src, global int *dst, int n, int shift, global int *histograms, global int *partials) {
+				   const int localId = get_local_id(0);
+				   const int localSize = get_local_size(0);
+				   const int start = chunkStart(n);
+				   const int end = chunkEnd(n);
+
+				   for (int digit = 0; digit < ALPHABET_SIZE; ++digit)
+				   {
+					   histograms[digit * localSize + localId] = 0;
+				   }
+				   for (int j = start; j < end; ++j)
+				   {
+					   histograms[((rank[src[j]] >> shift) & 0xff) * localSize + localId]++;
+				   }
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+
+				   groupExclusiveScan(histograms, ALPHABET_SIZE * localSize, partials);
+
+				   for (int j = start; j < end; ++j)
+				   {
+					   dst[histograms[((rank[src[j]] >> shift) & 0xff) * localSize + localId]++] = src[j];
+				   }
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+			   }
+
+			   // Whether sa[j] starts a new group: its rank, and for h > 0 the rank h symbols on, differ from sa[j - 1]
+			   bool bwtGroupHead(global int *sa, global int *rank, int n, int h, int j) {
+				   if (j == 0)
+				   {
+					   return true;
+				   }
+				   const int a = sa[j];
+				   const int b = sa[j - 1];
+				   if (rank[a] != rank[b])
+				   {
+					   return true;
+				   }
+				   return h > 0 && rank[a + h < n ? a + h : a + h - n] != rank[b + h < n ? b + h : b + h - n];
+			   }
+
+			   // Ranks the sorted rotations by the position of the first rotation of their group.
+			   // Returns the number of groups, the same in every work item.
+			   int bwtUpdateRanks(global int *sa, global int *rank, global int *newRank, int n, int h, global int *lastHeads, global int *headCnts) {
+				   const int localId = get_local_id(0);
+				   const int localSize = get_local_size(0);
+				   const int start = chunkStart(n);
+				   const int end = chunkEnd(n);
+
+				   int lastHead = 0;
+				   int headCnt = 0;
+				   for (int j = start; j < end; ++j)
+				   {
+					   if (bwtGroupHead(sa, rank, n, h, j))
+					   {
+						   lastHead = j;
+						   ++headCnt;
+					   }
+				   }
+				   lastHeads[localId] = lastHead;
+				   headCnts[localId] = headCnt;
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+
+				   int head = 0;
+				   int groupCnt = 0;
+				   for (int u = 0; u < localSize; ++u)
+				   {
+					   if (u < localId)
+					   {
+						   head = lastHeads[u] > head ? lastHeads[u] : head;
+					   }
+					   groupCnt += headCnts[u];
+				   }
+				   for (int j = start; j < end; ++j)
+				   {
+					   if (bwtGroupHead(sa, rank, n, h, j))
+					   {
+						   head = j;
+					   }
+					   newRank[sa[j]] = head;
+				   }
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+				   return groupCnt;
 			   }
 
+			   // Same rotation order and output as DivSufSortBWT, by prefix doubling: rotations sorted
+			   // by their first h symbols are sorted again by the rank of the rotation h symbols on,
+			   // which orders them by 2h symbols, until every rotation has a rank of its own or h spans
+			   // the block. Rotations still equal then (periodic blocks) end with the same symbol, so
+			   // their order doesn't change the output, the start pointer is the first of the group
+			   // of rotation 0 where DivSufSortBWT may pick another one of it. Returns the start pointer.
+			   // rankBuffers holds 2n ints, histograms ALPHABET_SIZE ints per work item and
+			   // partials and counts one int per work item.
+			   int CooperativeBWT(global unsigned char *T, global int *SA, global int *rankBuffers, int n, global int *histograms, global int *partials, global int *counts) {
+				   const int start = chunkStart(n);
+				   const int end = chunkEnd(n);
+				   global int *sa = SA;
+				   global int *rank = rankBuffers;
+				   global int *spare = rankBuffers + n;
+
+				   // Sorted by the first symbol
+				   for (int j = start; j < end; ++j)
+				   {
+					   rank[j] = T[j];
+					   spare[j] = j;
+				   }
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+				   bwtRadixPass(rank, spare, sa, n, 0, histograms, partials);
+				   int groupCnt = bwtUpdateRanks(sa, rank, spare, n, 0, partials, counts);
+				   global int *swap = rank;
+				   rank = spare;
+				   spare = swap;
+
+				   // Ranks are below n, one pass per byte of n - 1
+				   const int passCnt = n <= 0x100 ? 1 : (n <= 0x10000 ? 2 : 3);
+				   for (int h = 1; groupCnt < n && h < n; h <<= 1)
+				   {
+					   // Ordered by the rank h symbols on, the stable sort by rank keeps that within groups
+					   for (int j = start; j < end; ++j)
+					   {
+						   spare[j] = sa[j] >= h ? sa[j] - h : sa[j] - h + n;
+					   }
+					   barrier(CLK_GLOBAL_MEM_FENCE);
+					   for (int pass = 0; pass < passCnt; ++pass)
+					   {
+						   bwtRadixPass(rank, spare, sa, n, pass * 8, histograms, partials);
+						   if (pass + 1 < passCnt)
+						   {
+							   swap = sa;
+							   sa = spare;
+							   spare = swap;
+						   }
+					   }
+
+					   groupCnt = bwtUpdateRanks(sa, rank, spare, n, h, partials, counts);
+					   swap = rank;
+					   rank = spare;
+					   spare = swap;
+				   }
+
+				   // Ranks may live in SA, each work item reads only the sa entries it writes when sa is SA
+				   const int startPointer = rank[0];
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+				   for (int j = start; j < end; ++j)
+				   {
+					   const int rotation = sa[j];
+					   SA[j] = T[rotation > 0 ? rotation - 1 : n - 1];
+				   }
+				   return startPointer;
+			   }
+
+			   // One work-group per block. Leaves the rotation end symbols in bwtBlocks as DivSufSortBWT
+			   // does and the start pointer in the block state. Work-groups of up to ALPHABET_SIZE work
+			   // items, the histograms take the BWT bucket B space of the block.
+			   kernel void kernel_bwt(global bool *isEmptyCompressor,
+									  global unsigned char *blocks,
+									  global int *bwtBlocks,
+									  global size_t *blockLengths,
+									  global int *bwtRanks,
+									  global int *bucketsA,
+									  global int *bucketsB,
+									  global int *bwtTempBuffs,
+									  global int *blockStates,
+									  const int blockCnt,
+									  const unsigned int streamBlockSize) {
+				   const uint i = get_group_id(0);
+				   if (i >= (uint)blockCnt || isEmptyCompressor[i])
+				   {
+					   return;
+				   }
+
+				   const uint blockStride = streamBlockSize + 1;
+				   const int startPointer = CooperativeBWT(blocks + i * (ulong)blockStride,
+														   bwtBlocks + i * (ulong)blockStride,
+														   bwtRanks + 2 * (ulong)i * blockStride,
+														   blockLengths[i],
+														   bucketsB + i * BUCKET_B_SIZE,
+														   bucketsA + i * BUCKET_A_SIZE,
+														   bwtTempBuffs + i * ALPHABET_SIZE);
+				   if (get_local_id(0) == 0)
+				   {
+					   blockStates[i * BLOCK_STATE_SIZE + BLOCK_STATE_BWT_START_POINTER] = startPointer;
+				   }
+			   }) OPENCL_C_NEXT
+		   R(
 			   /* Write bits syntax */
-			   void writeBoolean(global bool *bitBuffer, global size_t *bitCount, bool value) {
-				   bitBuffer[(*bitCount)++] = value;
+			   struct BitWriter
+			   {
+				   global unsigned char *buffer;
+				   size_t byteCount;
+				   ulong bitAccumulator;
+				   uint bitsInAccumulator;
+			   };
+
+			   // Continues after bitCount bits already present in the buffer (block header written by the host)
+			   void initBitWriter(struct BitWriter *writer, global unsigned char *buffer, size_t bitCount) {
+				   writer->buffer = buffer;
+				   writer->byteCount = bitCount >> 3;
+				   writer->bitsInAccumulator = bitCount & 7;
+				   writer->bitAccumulator = writer->bitsInAccumulator ? (buffer[writer->byteCount] >> (8 - writer->bitsInAccumulator)) : 0;
 			   }
 
-			   void writeUnary(global bool *bitBuffer, global size_t *bitCount, int value) {
-				   while (value-- > 0)
+			   // Up to 24 bits at once, whole 32 bit words are emitted as they fill up
+			   void writeBits(struct BitWriter *writer, int count, int value) {
+				   writer->bitAccumulator = (writer->bitAccumulator << count) | (value & ((1U << count) - 1));
+				   writer->bitsInAccumulator += count;
+
+				   if (writer->bitsInAccumulator >= 32)
 				   {
-					   writeBoolean(bitBuffer, bitCount, true);
+					   writer->bitsInAccumulator -= 32;
+					   uint word = (uint)(writer->bitAccumulator >> writer->bitsInAccumulator);
+					   global unsigned char *out = writer->buffer + writer->byteCount;
+					   out[0] = (unsigned char)(word >> 24);
+					   out[1] = (unsigned char)(word >> 16);
+					   out[2] = (unsigned char)(word >> 8);
+					   out[3] = (unsigned char)word;
+					   writer->byteCount += 4;
 				   }
-				   writeBoolean(bitBuffer, bitCount, false);
 			   }
 
-			   void writeBits(global bool *bitBuffer, global size_t *bitCount, int count, int value) {
-				   for (int bitMask = (1 << (count - 1)); bitMask; bitMask >>= 1)
+			   void writeBoolean(struct BitWriter *writer, bool value) {
+				   writeBits(writer, 1, value ? 1 : 0);
+			   }
+
+			   void writeUnary(struct BitWriter *writer, int value) {
+				   while (value >= 24)
 				   {
-					   writeBoolean(bitBuffer, bitCount, bitMask & value);
+					   writeBits(writer, 24, 0xffffff);
+					   value -= 24;
 				   }
+				   writeBits(writer, value + 1, ((1 << value) - 1) << 1);
+			   }
+
+			   void writeInteger(struct BitWriter *writer, int value) {
+				   writeBits(writer, 16, (value >> 16) & 0xffff);
+				   writeBits(writer, 16, value & 0xffff);
 			   }
 
-			   void writeInteger(global bool *bitBuffer, global size_t *bitCount, int value) {
-				   writeBits(bitBuffer, bitCount, 16, (value >> 16) & 0xffff);
-				   writeBits(bitBuffer, bitCount, 16, value & 0xffff);
+			   // Writes out the remaining bits, the last byte is zero padded
+			   void flushBitWriter(struct BitWriter *writer, global size_t *bitCount) {
+				   while (writer->bitsInAccumulator >= 8)
+				   {
+					   writer->bitsInAccumulator -= 8;
+					   writer->buffer[writer->byteCount++] = (unsigned char)(writer->bitAccumulator >> writer->bitsInAccumulator);
+				   }
+				   if (writer->bitsInAccumulator)
+				   {
+					   writer->buffer[writer->byteCount] = (unsigned char)(writer->bitAccumulator << (8 - writer->bitsInAccumulator));
+				   }
+				   *bitCount = (writer->byteCount << 3) + writer->bitsInAccumulator;
 			   }
 
-			   void writeSymbolMap(global bool *bitBuffer, global size_t *bitCount, global bool *blockValuesPresent) {
+			   void writeSymbolMap(struct BitWriter *writer, global bool *blockValuesPresent) {
 				   bool condensedInUse[16] = {0};
 				   for (int i = 0; i < 16; ++i)
 				   {
@@ -2495,7 +2771,7 @@ string opencl_c_container()
 
 				   for (int i = 0; i < 16; ++i)
 				   {
-					   writeBoolean(bitBuffer, bitCount, condensedInUse[i]);
+					   writeBoolean(writer, condensedInUse[i]);
 				   }
 
 				   for (int i = 0; i < 16; ++i)
@@ -2504,7 +2780,7 @@ string opencl_c_container()
 					   {
 						   for (int j = 0, k = i * 16; j < 16; ++j, ++k)
 						   {
-							   writeBoolean(bitBuffer, bitCount, blockValuesPresent[k]);
+							   writeBoolean(writer, blockValuesPresent[k]);
 						   }
 					   }
 				   }
@@ -2559,6 +2835,12 @@ string opencl_c_container()
 			   };
 
 			   struct MTFResult MTFAndRLE2StageEncoder(global int *bwtBlock, int bwtLength, global bool *bwtValuesInUse, global int *mtfSymbolFrequencies, global int *huffmanSymbolMap, global int *symbolMTF) {
+				   // Frequency buffers are reused by the next batch
+				   for (int i = 0; i < HUFFMAN_MAXIMUM_ALPHABET_SIZE; i++)
+				   {
+					   mtfSymbolFrequencies[i] = 0;
+				   }
+
 				   int totalUniqueValues = 0;
 				   for (int i = 0; i < ALPHABET_SIZE; i++)
 				   {
@@ -2646,8 +2928,319 @@ string opencl_c_container()
 				   int alphabetSize = endOfBlockSymbol + 1;
 				   struct MTFResult res = {mtfLength, alphabetSize};
 				   return res;
+			   }) OPENCL_C_NEXT
+		   R(/* Cooperative MTF and RLE2, the whole work-group encodes one block */
+
+			   // Number of RUNA/RUNB symbols MTFAndRLE2StageEncoder writes for a run of zeros
+			   int runSymbolCount(int runLength) {
+				   int count = 0;
+				   if (runLength > 0)
+				   {
+					   runLength--;
+					   while (true)
+					   {
+						   count++;
+						   if (runLength <= 1)
+						   {
+							   break;
+						   }
+						   runLength = (runLength - 2) >> 1;
+					   }
+				   }
+				   return count;
 			   }
 
+			   // Writes the RUNA/RUNB symbols of a run of zeros, returns the index after them
+			   int writeRunSymbols(global int *mtfBlock, int mtfIndex, int runLength, int *totalRunAs, int *totalRunBs) {
+				   if (runLength > 0)
+				   {
+					   runLength--;
+					   while (true)
+					   {
+						   if ((runLength & 1) == 0)
+						   {
+							   mtfBlock[mtfIndex++] = HUFFMAN_SYMBOL_RUNA;
+							   (*totalRunAs)++;
+						   }
+						   else
+						   {
+							   mtfBlock[mtfIndex++] = HUFFMAN_SYMBOL_RUNB;
+							   (*totalRunBs)++;
+						   }
+
+						   if (runLength <= 1)
+						   {
+							   break;
+						   }
+						   runLength = (runLength - 2) >> 1;
+					   }
+				   }
+				   return mtfIndex;
+			   }
+
+			   void siftDownMin(int *keys, int root, int size) {
+				   while (2 * root + 1 < size)
+				   {
+					   int child = 2 * root + 1;
+					   if (child + 1 < size && keys[child + 1] < keys[child])
+					   {
+						   child++;
+					   }
+					   if (keys[root] <= keys[child])
+					   {
+						   return;
+					   }
+					   const int temp = keys[root];
+					   keys[root] = keys[child];
+					   keys[child] = temp;
+					   root = child;
+				   }
+			   }
+
+			   // Heap sort, largest key first
+			   void sortDescending(int *keys, int size) {
+				   for (int root = size / 2 - 1; root >= 0; --root)
+				   {
+					   siftDownMin(keys, root, size);
+				   }
+				   for (int last = size - 1; last > 0; --last)
+				   {
+					   const int temp = keys[0];
+					   keys[0] = keys[last];
+					   keys[last] = temp;
+					   siftDownMin(keys, 0, last);
+				   }
+			   }
+
+			   // Same output, symbol frequencies and lengths as MTFAndRLE2StageEncoder. Every work item
+			   // moves symbols to front over its own chunk of the block, starting from the list the
+			   // chunks before leave: the symbols seen so far, most recent first, then the unseen ones
+			   // in their initial order. A run of zeros is written by the chunk it ends in, with the
+			   // part carried over from the chunks before. mtfPositions holds bwtLength ints, tables
+			   // ALPHABET_SIZE ints per work item and partials and counts one int per work item.
+			   void CooperativeMTFAndRLE2(global int *bwtBlock,
+										  int bwtLength,
+										  global bool *bwtValuesInUse,
+										  global int *mtfSymbolFrequencies,
+										  global int *huffmanSymbolMap,
+										  global int *mtfPositions,
+										  global int *tables,
+										  global int *partials,
+										  global int *counts,
+										  global int *blockState) {
+				   const int localId = get_local_id(0);
+				   const int localSize = get_local_size(0);
+				   const int start = chunkStart(bwtLength);
+				   const int end = chunkEnd(bwtLength);
+
+				   int totalUniqueValues = 0;
+				   for (int i = 0; i < ALPHABET_SIZE; i++)
+				   {
+					   if (bwtValuesInUse[i])
+					   {
+						   if (localId == 0)
+						   {
+							   huffmanSymbolMap[i] = totalUniqueValues;
+						   }
+						   totalUniqueValues++;
+					   }
+					   else if (localId == 0)
+					   {
+						   huffmanSymbolMap[i] = 0;
+					   }
+				   }
+				   for (int i = localId; i < HUFFMAN_MAXIMUM_ALPHABET_SIZE; i += localSize)
+				   {
+					   mtfSymbolFrequencies[i] = 0;
+				   }
+
+				   // Last position of every symbol in the chunk
+				   for (int value = 0; value < ALPHABET_SIZE; value++)
+				   {
+					   tables[value * localSize + localId] = -1;
+				   }
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+				   for (int i = start; i < end; i++)
+				   {
+					   tables[huffmanSymbolMap[bwtBlock[i] & 0xff] * localSize + localId] = i;
+				   }
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+
+				   // Last position before each chunk
+				   for (int value = localId; value < ALPHABET_SIZE; value += localSize)
+				   {
+					   int last = -1;
+					   for (int chunk = 0; chunk < localSize; chunk++)
+					   {
+						   const int chunkLast = tables[value * localSize + chunk];
+						   tables[value * localSize + chunk] = last;
+						   last = chunkLast > last ? chunkLast : last;
+					   }
+				   }
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+
+				   // MTF list at the chunk start, seen symbols ordered by position and symbol packed in one key
+				   int symbolMTF[ALPHABET_SIZE];
+				   int seenValues = 0;
+				   for (int value = 0; value < totalUniqueValues; value++)
+				   {
+					   const int last = tables[value * localSize + localId];
+					   if (last >= 0)
+					   {
+						   symbolMTF[seenValues++] = (last << 8) | value;
+					   }
+				   }
+				   sortDescending(symbolMTF, seenValues);
+				   for (int j = 0; j < seenValues; j++)
+				   {
+					   symbolMTF[j] &= 0xff;
+				   }
+				   for (int value = 0; value < totalUniqueValues; value++)
+				   {
+					   if (tables[value * localSize + localId] < 0)
+					   {
+						   symbolMTF[seenValues++] = value;
+					   }
+				   }
+
+				   int trailingZeros = 0;
+				   int hasLiterals = 0;
+				   for (int i = start; i < end; i++)
+				   {
+					   const int mtfPosition = valueToFrontNonGlobal(symbolMTF, huffmanSymbolMap[bwtBlock[i] & 0xff]);
+					   mtfPositions[i] = mtfPosition;
+					   trailingZeros = mtfPosition == 0 ? trailingZeros + 1 : 0;
+					   hasLiterals |= mtfPosition != 0;
+				   }
+				   partials[localId] = trailingZeros;
+				   counts[localId] = hasLiterals;
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+
+				   // Zeros left open by the chunks before, back to the last one with a literal
+				   int carriedZeros = 0;
+				   for (int chunk = localId - 1; chunk >= 0; chunk--)
+				   {
+					   carriedZeros += partials[chunk];
+					   if (counts[chunk])
+					   {
+						   break;
+					   }
+				   }
+
+				   // Output of the chunk, the last one closes the block
+				   int mtfCount = 0;
+				   int repeatCount = carriedZeros;
+				   for (int i = start; i < end; i++)
+				   {
+					   if (mtfPositions[i] == 0)
+					   {
+						   repeatCount++;
+					   }
+					   else
+					   {
+						   mtfCount += runSymbolCount(repeatCount) + 1;
+						   repeatCount = 0;
+					   }
+				   }
+				   if (localId == localSize - 1)
+				   {
+					   mtfCount += runSymbolCount(repeatCount) + 1;
+				   }
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+				   partials[localId] = mtfCount;
+				   groupExclusiveScan(partials, localSize, counts);
+
+				   // Literal frequencies by MTF position, RUNA counts take position 0
+				   for (int value = 0; value < ALPHABET_SIZE; value++)
+				   {
+					   tables[value * localSize + localId] = 0;
+				   }
+				   int mtfIndex = partials[localId];
+				   int totalRunAs = 0;
+				   int totalRunBs = 0;
+				   repeatCount = carriedZeros;
+				   for (int i = start; i < end; i++)
+				   {
+					   const int mtfPosition = mtfPositions[i];
+					   if (mtfPosition == 0)
+					   {
+						   repeatCount++;
+					   }
+					   else
+					   {
+						   mtfIndex = writeRunSymbols(bwtBlock, mtfIndex, repeatCount, &totalRunAs, &totalRunBs);
+						   repeatCount = 0;
+						   bwtBlock[mtfIndex++] = mtfPosition + 1;
+						   tables[mtfPosition * localSize + localId]++;
+					   }
+				   }
+				   if (localId == localSize - 1)
+				   {
+					   mtfIndex = writeRunSymbols(bwtBlock, mtfIndex, repeatCount, &totalRunAs, &totalRunBs);
+					   bwtBlock[mtfIndex++] = totalUniqueValues + 1;
+					   blockState[BLOCK_STATE_MTF_LENGTH] = mtfIndex;
+					   blockState[BLOCK_STATE_MTF_ALPHABET_SIZE] = totalUniqueValues + 2;
+				   }
+				   tables[localId] = totalRunAs;
+				   partials[localId] = totalRunBs;
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+
+				   for (int mtfPosition = localId; mtfPosition < totalUniqueValues; mtfPosition += localSize)
+				   {
+					   int frequency = 0;
+					   for (int chunk = 0; chunk < localSize; chunk++)
+					   {
+						   frequency += tables[mtfPosition * localSize + chunk];
+					   }
+					   mtfSymbolFrequencies[mtfPosition == 0 ? HUFFMAN_SYMBOL_RUNA : mtfPosition + 1] = frequency;
+				   }
+				   if (localId == 0)
+				   {
+					   int frequency = 0;
+					   for (int chunk = 0; chunk < localSize; chunk++)
+					   {
+						   frequency += partials[chunk];
+					   }
+					   mtfSymbolFrequencies[HUFFMAN_SYMBOL_RUNB] = frequency;
+					   mtfSymbolFrequencies[totalUniqueValues + 1] = 1; // End of block
+				   }
+			   }
+
+			   // One work-group per block, after kernel_bwt. The MTF positions take the rank buffers
+			   // of the block and the tables its BWT bucket B space, so work-groups hold up to
+			   // ALPHABET_SIZE work items.
+			   kernel void kernel_mtf(global bool *isEmptyCompressor,
+									  global int *bwtBlocks,
+									  global size_t *blockLengths,
+									  global bool *blocksValuePresent,
+									  global int *mtfsSymbolFrequencies,
+									  global int *huffmanSymbolMaps,
+									  global int *bwtRanks,
+									  global int *bucketsA,
+									  global int *bucketsB,
+									  global int *bwtTempBuffs,
+									  global int *blockStates,
+									  const int blockCnt,
+									  const unsigned int streamBlockSize) {
+				   const uint i = get_group_id(0);
+				   if (i >= (uint)blockCnt || isEmptyCompressor[i])
+				   {
+					   return;
+				   }
+
+				   const uint blockStride = streamBlockSize + 1;
+				   CooperativeMTFAndRLE2(bwtBlocks + i * (ulong)blockStride,
+										 blockLengths[i],
+										 blocksValuePresent + i * ALPHABET_SIZE,
+										 mtfsSymbolFrequencies + i * HUFFMAN_MAXIMUM_ALPHABET_SIZE,
+										 huffmanSymbolMaps + i * ALPHABET_SIZE,
+										 bwtRanks + 2 * (ulong)i * blockStride,
+										 bucketsB + i * BUCKET_B_SIZE,
+										 bucketsA + i * BUCKET_A_SIZE,
+										 bwtTempBuffs + i * ALPHABET_SIZE,
+										 blockStates + i * BLOCK_STATE_SIZE);
+			   }) OPENCL_C_NEXT
+		   R(
 			   /* HUFFMAN */
 			   int SignificantBits(int x) {
 				   int n;
@@ -2786,6 +3379,8 @@ string opencl_c_container()
 				   {
 				   case 2:
 					   array[1] = 1;
+					   array[0] = 1;
+					   return;
 				   case 1:
 					   array[0] = 1;
 					   return;
@@ -2803,7 +3398,7 @@ string opencl_c_container()
 					   int insertDepth = maximumLength - SignificantBits(nodesToRelocate - 1);
 					   allocateNodeLengthsWithRelocation(array, arraySize, nodesToRelocate, insertDepth);
 				   }
-			   }) +
+			   }) OPENCL_C_NEXT
 		   R(
 			   int selectTableCount(int mtfLength) {
 				   if (mtfLength >= 2400)
@@ -2817,21 +3412,6 @@ string opencl_c_container()
 				   return 2;
 			   }
 
-			   void sortArr(int *a, int size) {
-				   for (int i = 0; i < size; ++i)
-				   {
-					   for (int j = i + 1; j < size; ++j)
-					   {
-						   if (a[i] > a[j])
-						   {
-							   int temp = a[i];
-							   a[i] = a[j];
-							   a[j] = temp;
-						   }
-					   }
-				   }
-			   }
-
 			   void generateHuffmanCodeLengths(int alphabetSize, int *symbolFrequencies, int *codeLengths) {
 				   int mergedFrequenciesAndIndices[HUFFMAN_MAXIMUM_ALPHABET_SIZE];
 				   int sortedFrequencies[HUFFMAN_MAXIMUM_ALPHABET_SIZE];
@@ -2841,26 +3421,30 @@ string opencl_c_container()
 					   mergedFrequenciesAndIndices[i] = (symbolFrequencies[i] << 9) | i;
 				   }
 
-				   sortArr(mergedFrequenciesAndIndices, alphabetSize);
+				   // Keys are unique, so the heap sort orders them as any other sort would. The
+				   // allocator takes the frequencies in ascending order, the heap sorts them descending.
+				   sortDescending(mergedFrequenciesAndIndices, alphabetSize);
 
 				   for (int i = 0; i < alphabetSize; i++)
 				   {
-					   sortedFrequencies[i] = mergedFrequenciesAndIndices[i] >> 9;
+					   sortedFrequencies[i] = mergedFrequenciesAndIndices[alphabetSize - 1 - i] >> 9;
 				   }
 
 				   allocateHuffmanCodeLengths(sortedFrequencies, alphabetSize, HUFFMAN_ENCODE_MAXIMUM_CODE_LENGTH);
 
 				   for (int i = 0; i < alphabetSize; i++)
 				   {
-					   codeLengths[mergedFrequenciesAndIndices[i] & 0x1ff] = sortedFrequencies[i];
+					   codeLengths[mergedFrequenciesAndIndices[alphabetSize - 1 - i] & 0x1ff] = sortedFrequencies[i];
 				   }
 			   }
 
-			   void generateHuffmanOptimisationSeeds(int mtfLength,
-													 int mtfAlphabetSize,
-													 global int *mtfSymbolFrequencies,
-													 int huffmanCodeLengths[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE],
-													 int totalTables) {
+			   // Symbols from lowCostStarts[i] to lowCostEnds[i] are cheap in seed table i, the ranges split the MTF length evenly
+			   void huffmanSeedRanges(int mtfLength,
+									  int mtfAlphabetSize,
+									  global int *mtfSymbolFrequencies,
+									  int totalTables,
+									  int *lowCostStarts,
+									  int *lowCostEnds) {
 				   int remainingLength = mtfLength;
 				   int lowCostEnd = -1;
 
@@ -2880,15 +3464,30 @@ string opencl_c_container()
 						   actualCumulativeFrequency -= mtfSymbolFrequencies[lowCostEnd--];
 					   }
 
+					   lowCostStarts[i] = lowCostStart;
+					   lowCostEnds[i] = lowCostEnd;
+					   remainingLength -= actualCumulativeFrequency;
+				   }
+			   }
+
+			   void generateHuffmanOptimisationSeeds(int mtfLength,
+													 int mtfAlphabetSize,
+													 global int *mtfSymbolFrequencies,
+													 int huffmanCodeLengths[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE],
+													 int totalTables) {
+				   int lowCostStarts[HUFFMAN_MAXIMUM_TABLES];
+				   int lowCostEnds[HUFFMAN_MAXIMUM_TABLES];
+				   huffmanSeedRanges(mtfLength, mtfAlphabetSize, mtfSymbolFrequencies, totalTables, lowCostStarts, lowCostEnds);
+
+				   for (int i = 0; i < totalTables; i++)
+				   {
 					   for (int j = 0; j < mtfAlphabetSize; j++)
 					   {
-						   if ((j < lowCostStart) || (j > lowCostEnd))
+						   if ((j < lowCostStarts[i]) || (j > lowCostEnds[i]))
 						   {
 							   huffmanCodeLengths[i][j] = HUFFMAN_HIGH_SYMBOL_COST;
 						   }
 					   }
-
-					   remainingLength -= actualCumulativeFrequency;
 				   }
 			   }
 
@@ -2899,7 +3498,7 @@ string opencl_c_container()
 													  int totalTables,
 													  global int *selectors,
 													  bool storeSelectors) {
-				   int tableFrequencies[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE];
+				   int tableFrequencies[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE] = {0};
 				   int cost[HUFFMAN_MAXIMUM_TABLES];
 
 				   int selectorIndex = 0;
@@ -2950,56 +3549,53 @@ string opencl_c_container()
 				   }
 			   }
 
+			   // Merged code symbols hold the code length in the top byte and the code below it.
+			   // Canonical codes: shorter codes first, symbol order within a length.
+			   void assignTableCodeSymbols(int mtfAlphabetSize, int *codeLengths, global int *mergedCodeSymbols) {
+				   int nextCodes[HUFFMAN_ENCODE_MAXIMUM_CODE_LENGTH + 1] = {0};
+				   for (int k = 0; k < mtfAlphabetSize; k++)
+				   {
+					   nextCodes[codeLengths[k]]++;
+				   }
+
+				   // Codes of each length follow those one bit shorter, lengths nobody uses keep code 0
+				   int code = 0;
+				   for (int j = 1; j <= HUFFMAN_ENCODE_MAXIMUM_CODE_LENGTH; j++)
+				   {
+					   const int lengthCount = nextCodes[j];
+					   nextCodes[j] = code;
+					   code = (code + lengthCount) << 1;
+				   }
+
+				   for (int k = 0; k < mtfAlphabetSize; k++)
+				   {
+					   const int length = codeLengths[k];
+					   mergedCodeSymbols[k] = (length << 24) | nextCodes[length]++;
+				   }
+			   }
+
+			   // Tables are HUFFMAN_MAXIMUM_ALPHABET_SIZE apart in huffmanMergedCodeSymbols
 			   void assignHuffmanCodeSymbols(int mtfAlphabetSize,
 											 int huffmanCodeLengths[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE],
-											 int huffmanMergedCodeSymbols[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE],
+											 global int *huffmanMergedCodeSymbols,
 											 int totalTables) {
 				   for (int i = 0; i < totalTables; i++)
 				   {
-					   int minimumLength = 32;
-					   int maximumLength = 0;
-
-					   for (int j = 0; j < mtfAlphabetSize; ++j)
-					   {
-						   int length = huffmanCodeLengths[i][j];
-						   if (length > maximumLength)
-						   {
-							   maximumLength = length;
-						   }
-						   if (length < minimumLength)
-						   {
-							   minimumLength = length;
-						   }
-					   }
-
-					   int code = 0;
-					   for (int j = minimumLength; j <= maximumLength; j++)
-					   {
-						   for (int k = 0; k < mtfAlphabetSize; k++)
-						   {
-							   if ((huffmanCodeLengths[i][k] & 0xff) == j)
-							   {
-								   huffmanMergedCodeSymbols[i][k] = (j << 24) | code;
-								   code++;
-							   }
-						   }
-						   code <<= 1;
-					   }
+					   assignTableCodeSymbols(mtfAlphabetSize, huffmanCodeLengths[i], huffmanMergedCodeSymbols + i * HUFFMAN_MAXIMUM_ALPHABET_SIZE);
 				   }
 			   }
 
-			   void writeSelectorsAndHuffmanTables(global bool *bitBuffer,
-												   global size_t *bitCount,
+			   void writeSelectorsAndHuffmanTables(struct BitWriter *writer,
 												   global int *selectors,
 												   int selectorsSize,
-												   int huffmanCodeLengths[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE],
+												   global int *huffmanMergedCodeSymbols,
 												   int huffmanCodeLengthsSize,
 												   int mtfAlphabetSize) {
 				   int totalTables = huffmanCodeLengthsSize;
 				   int totalSelectors = selectorsSize;
 
-				   writeBits(bitBuffer, bitCount, 3, totalTables);
-				   writeBits(bitBuffer, bitCount, 15, totalSelectors);
+				   writeBits(writer, 3, totalTables);
+				   writeBits(writer, 15, totalSelectors);
 
 				   int symbolMTF[ALPHABET_SIZE] = {0};
 				   for (int i = 0; i < ALPHABET_SIZE; ++i)
@@ -3008,20 +3604,20 @@ string opencl_c_container()
 				   }
 				   for (int i = 0; i < totalSelectors; i++)
 				   {
-					   writeUnary(bitBuffer, bitCount, valueToFrontNonGlobal(symbolMTF, selectors[i]));
+					   writeUnary(writer, valueToFrontNonGlobal(symbolMTF, selectors[i]));
 				   }
 
-				   // Write the Huffman tables
+				   // Write the Huffman tables, code lengths are the top byte of the merged code symbols
 				   for (int i = 0; i < huffmanCodeLengthsSize; ++i)
 				   {
-					   int *tableLengths = huffmanCodeLengths[i];
-					   int currentLength = tableLengths[0];
+					   global int *tableMergedCodeSymbols = huffmanMergedCodeSymbols + i * HUFFMAN_MAXIMUM_ALPHABET_SIZE;
+					   int currentLength = tableMergedCodeSymbols[0] >> 24;
 
-					   writeBits(bitBuffer, bitCount, 5, currentLength);
+					   writeBits(writer, 5, currentLength);
 
 					   for (int j = 0; j < mtfAlphabetSize; j++)
 					   {
-						   int codeLength = tableLengths[j];
+						   int codeLength = tableMergedCodeSymbols[j] >> 24;
 						   int value = (currentLength < codeLength) ? 2 : 3;
 
 						   int delta = codeLength - currentLength;
@@ -3032,46 +3628,43 @@ string opencl_c_container()
 
 						   while (delta-- > 0)
 						   {
-							   writeBits(bitBuffer, bitCount, 2, value);
+							   writeBits(writer, 2, value);
 						   }
-						   writeBoolean(bitBuffer, bitCount, false);
+						   writeBoolean(writer, false);
 						   currentLength = codeLength;
 					   }
 				   }
 			   }
 
-			   void writeBlockData(global bool *bitBuffer,
-								   global size_t *bitCount,
+			   void writeBlockData(struct BitWriter *writer,
 								   global int *mtfBlock,
 								   int mtfLength,
 								   global int *selectors,
-								   int huffmanMergedCodeSymbols[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE]) {
+								   global int *huffmanMergedCodeSymbols) {
 				   int selectorIndex = 0;
 				   int mtfIndex = 0;
 				   while (mtfIndex < mtfLength)
 				   {
 					   int groupEnd = (mtfIndex + HUFFMAN_GROUP_RUN_LENGTH < mtfLength ? mtfIndex + HUFFMAN_GROUP_RUN_LENGTH : mtfLength) - 1;
-					   int *tableMergedCodeSymbols = huffmanMergedCodeSymbols[selectors[selectorIndex++]];
+					   global int *tableMergedCodeSymbols = huffmanMergedCodeSymbols + selectors[selectorIndex++] * HUFFMAN_MAXIMUM_ALPHABET_SIZE;
 
 					   while (mtfIndex <= groupEnd)
 					   {
 						   int mergedCodeSymbol = tableMergedCodeSymbols[mtfBlock[mtfIndex++]];
-						   writeBits(bitBuffer, bitCount, mergedCodeSymbol >> 24, mergedCodeSymbol);
+						   writeBits(writer, mergedCodeSymbol >> 24, mergedCodeSymbol);
 					   }
 				   }
 			   }
 
-			   void HuffmanStageEncoder(global bool *bitBuffer,
-										global size_t *bitCount,
-										global int *mtfBlock,
-										int mtfLength,
-										int mtfAlphabetSize,
-										global int *mtfSymbolFrequencies,
-										global int *selectors) {
+			   // Selectors and merged code symbols of every table, written out by close_block
+			   void HuffmanStageTables(global int *mtfBlock,
+									   int mtfLength,
+									   int mtfAlphabetSize,
+									   global int *mtfSymbolFrequencies,
+									   global int *selectors,
+									   global int *huffmanMergedCodeSymbols) {
 				   int totalTables = selectTableCount(mtfLength);
 				   int huffmanCodeLengths[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE] = {0};
-				   int huffmanMergedCodeSymbols[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE] = {0};
-				   int selectorsSize = (mtfLength + HUFFMAN_GROUP_RUN_LENGTH - 1) / HUFFMAN_GROUP_RUN_LENGTH;
 
 				   generateHuffmanOptimisationSeeds(mtfLength,
 													mtfAlphabetSize,
@@ -3090,73 +3683,660 @@ string opencl_c_container()
 														 i == 0);
 				   }
 				   assignHuffmanCodeSymbols(mtfAlphabetSize, huffmanCodeLengths, huffmanMergedCodeSymbols, totalTables);
+			   }
 
-				   writeSelectorsAndHuffmanTables(bitBuffer, bitCount, selectors, selectorsSize, huffmanCodeLengths, totalTables, mtfAlphabetSize);
-				   writeBlockData(bitBuffer, bitCount, mtfBlock, mtfLength, selectors, huffmanMergedCodeSymbols);
+			   // Everything between the block header and the block data
+			   void writeBlockTables(struct BitWriter *writer,
+									 global bool *blockValuesPresent,
+									 global int *selectors,
+									 global int *huffmanMergedCodeSymbols,
+									 global int *blockState) {
+				   const int mtfLength = blockState[BLOCK_STATE_MTF_LENGTH];
+				   writeBits(writer, 24, blockState[BLOCK_STATE_BWT_START_POINTER]);
+				   writeSymbolMap(writer, blockValuesPresent);
+				   writeSelectorsAndHuffmanTables(writer,
+												  selectors,
+												  (mtfLength + HUFFMAN_GROUP_RUN_LENGTH - 1) / HUFFMAN_GROUP_RUN_LENGTH,
+												  huffmanMergedCodeSymbols,
+												  selectTableCount(mtfLength),
+												  blockState[BLOCK_STATE_MTF_ALPHABET_SIZE]);
 			   }
 
-			   /* Run MTF, RLE2, HUFFMAN */
+			   /* Run BWT, MTF, RLE2, HUFFMAN, the whole block on one work item */
 			   void close_block(global unsigned char *preBWTblock,
 								global int *block,
 								int blockLength,
 								global int *bucketA,
 								global int *bucketB,
 								global int *bwtTempBuff,
-								global bool *bitBuffer,
+								global unsigned char *bitBuffer,
 								global size_t *bitCount,
 								global bool *blockValuesPresent,
 								global int *mtfSymbolFrequencies,
 								global int *huffmanSymbolMap,
 								global int *symbolMTF,
-								global int *selectors) {
+								global int *selectors,
+								global int *huffmanMergedCodeSymbols,
+								global int *blockState) {
 				   // Wrap for BWT
 				   preBWTblock[blockLength] = preBWTblock[0];
-				   int bwtStartPointer = DivSufSortBWT(preBWTblock, block, bucketA, bucketB, bwtTempBuff, blockLength);
+				   blockState[BLOCK_STATE_BWT_START_POINTER] = DivSufSortBWT(preBWTblock, block, bucketA, bucketB, bwtTempBuff, blockLength);
 
-				   writeBits(bitBuffer, bitCount, 24, bwtStartPointer);
-
-				   writeSymbolMap(bitBuffer, bitCount, blockValuesPresent);
 				   struct MTFResult mtfEncoder = MTFAndRLE2StageEncoder(block, blockLength, blockValuesPresent, mtfSymbolFrequencies, huffmanSymbolMap, symbolMTF);
+				   blockState[BLOCK_STATE_MTF_LENGTH] = mtfEncoder.mtfLength;
+				   blockState[BLOCK_STATE_MTF_ALPHABET_SIZE] = mtfEncoder.alphabetSize;
+
+				   HuffmanStageTables(block, mtfEncoder.mtfLength, mtfEncoder.alphabetSize, mtfSymbolFrequencies, selectors, huffmanMergedCodeSymbols);
+
+				   struct BitWriter writer;
+				   initBitWriter(&writer, bitBuffer, *bitCount);
+				   writeBlockTables(&writer, blockValuesPresent, selectors, huffmanMergedCodeSymbols, blockState);
+				   writeBlockData(&writer, block, mtfEncoder.mtfLength, selectors, huffmanMergedCodeSymbols);
+				   flushBitWriter(&writer, bitCount);
+			   }
+
+			   /* RLE1, for raw input uploaded by the host */
+			   constant uint CRC32_TABLE[256] = {0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
+										   0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61, 0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd,
+										   0x4c11db70, 0x48d0c6c7, 0x4593e01e, 0x4152fda9, 0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
+										   0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011, 0x791d4014, 0x7ddc5da3, 0x709f7b7a, 0x745e66cd,
+										   0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039, 0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5,
+										   0xbe2b5b58, 0xbaea46ef, 0xb7a96036, 0xb3687d81, 0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
+										   0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49, 0xc7361b4c, 0xc3f706fb, 0xceb42022, 0xca753d95,
+										   0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1, 0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d,
+										   0x34867077, 0x30476dc0, 0x3d044b19, 0x39c556ae, 0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
+										   0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16, 0x018aeb13, 0x054bf6a4, 0x0808d07d, 0x0cc9cdca,
+										   0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde, 0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02,
+										   0x5e9f46bf, 0x5a5e5b08, 0x571d7dd1, 0x53dc6066, 0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
+										   0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e, 0xbfa1b04b, 0xbb60adfc, 0xb6238b25, 0xb2e29692,
+										   0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6, 0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a,
+										   0xe0b41de7, 0xe4750050, 0xe9362689, 0xedf73b3e, 0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
+										   0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686, 0xd5b88683, 0xd1799b34, 0xdc3abded, 0xd8fba05a,
+										   0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637, 0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb,
+										   0x4f040d56, 0x4bc510e1, 0x46863638, 0x42472b8f, 0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
+										   0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47, 0x36194d42, 0x32d850f5, 0x3f9b762c, 0x3b5a6b9b,
+										   0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff, 0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623,
+										   0xf12f560e, 0xf5ee4bb9, 0xf8ad6d60, 0xfc6c70d7, 0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
+										   0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f, 0xc423cd6a, 0xc0e2d0dd, 0xcda1f604, 0xc960ebb3,
+										   0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7, 0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b,
+										   0x9b3660c6, 0x9ff77d71, 0x92b45ba8, 0x9675461f, 0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
+										   0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640, 0x4e8ee645, 0x4a4ffbf2, 0x470cdd2b, 0x43cdc09c,
+										   0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8, 0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24,
+										   0x119b4be9, 0x155a565e, 0x18197087, 0x1cd86d30, 0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
+										   0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088, 0x2497d08d, 0x2056cd3a, 0x2d15ebe3, 0x29d4f654,
+										   0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0, 0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c,
+										   0xe3a1cbc1, 0xe760d676, 0xea23f0af, 0xeee2ed18, 0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
+										   0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0, 0x9abc8bd5, 0x9e7d9662, 0x933eb0bb, 0x97ffad0c,
+										   0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668, 0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4};
+
+			   // Same bytes as BlockCompressor::writeRun, returns the new block length
+			   int writeRLERun(global unsigned char *block, int blockLength, global bool *blockValuesPresent, unsigned char value, int runLength) {
+				   blockValuesPresent[value] = true;
+				   block[blockLength++] = value;
+				   if (runLength > 1)
+				   {
+					   block[blockLength++] = value;
+					   if (runLength > 2)
+					   {
+						   block[blockLength++] = value;
+						   if (runLength > 3)
+						   {
+							   runLength -= 4;
+							   blockValuesPresent[runLength] = true;
+							   block[blockLength++] = value;
+							   block[blockLength++] = (unsigned char)runLength;
+						   }
+					   }
+				   }
+				   return blockLength;
+			   }
+
+			   // One work item per block: the host split the raw input where BlockCompressor
+			   // would have, runs up to 255 bytes never cross a block
+			   kernel void kernel_rle1(global unsigned char *rawInput,
+									   global ulong *rawBlockOffsets,
+									   global bool *isEmptyCompressor,
+									   global unsigned char *blocks,
+									   global size_t *blockLengths,
+									   global int *blockCRCs,
+									   global bool *blocksValuePresent,
+									   const int blockCnt,
+									   const unsigned int streamBlockSize) {
+				   const uint i = get_global_id(0);
+				   if (i >= (uint)blockCnt || isEmptyCompressor[i])
+				   {
+					   return;
+				   }
+
+				   global unsigned char *raw = rawInput + rawBlockOffsets[i];
+				   const ulong rawLength = rawBlockOffsets[i + 1] - rawBlockOffsets[i];
+				   global unsigned char *block = blocks + i * (ulong)(streamBlockSize + 1);
+				   global bool *blockValuesPresent = blocksValuePresent + i * ALPHABET_SIZE;
+				   for (int j = 0; j < ALPHABET_SIZE; ++j)
+				   {
+					   blockValuesPresent[j] = false;
+				   }
+
+				   uint crc = 0xffffffff;
+				   int blockLength = 0;
+				   ulong position = 0;
+				   while (position < rawLength)
+				   {
+					   const unsigned char value = raw[position];
+					   ulong runEnd = position + 1;
+					   while (runEnd < rawLength && runEnd - position < 255 && raw[runEnd] == value)
+					   {
+						   ++runEnd;
+					   }
+
+					   const int runLength = (int)(runEnd - position);
+					   for (int j = 0; j < runLength; ++j)
+					   {
+						   crc = (crc << 8) ^ CRC32_TABLE[(crc >> 24) ^ value];
+					   }
+					   blockLength = writeRLERun(block, blockLength, blockValuesPresent, value, runLength);
+					   position = runEnd;
+				   }
 
-				   HuffmanStageEncoder(bitBuffer, bitCount, block, mtfEncoder.mtfLength, mtfEncoder.alphabetSize, mtfSymbolFrequencies, selectors);
+				   blockLengths[i] = blockLength;
+				   blockCRCs[i] = (int)~crc;
 			   }
 
+			   void writeBlockHeader(global unsigned char *bitBuffer, global size_t *bitCount, int blockCRC) {
+				   struct BitWriter writer;
+				   initBitWriter(&writer, bitBuffer, 0);
+				   writeBits(&writer, 24, BLOCK_HEADER_MARKER_1);
+				   writeBits(&writer, 24, BLOCK_HEADER_MARKER_2);
+				   writeInteger(&writer, blockCRC);
+				   writeBoolean(&writer, false); // Randomised block flag
+				   flushBitWriter(&writer, bitCount);
+			   }
+
+			   // One work item per whole block, the serial path of the CPU backend and --verify. The
+			   // device runs the stage kernels instead, kernel_bwt to kernel_huffman_emit.
 			   kernel void kernel_close(global bool *isEmptyCompressor,
+										global int *blockCRCs,
 										global unsigned char *blocks,
 										global int *bwtBlocks,
 										global size_t *blockLengths,
 										global int *bucketsA,
 										global int *bucketsB,
 										global int *bwtTempBuffs,
-										global bool *bitOutBuffers,
+										global unsigned char *bitOutBuffers,
 										global size_t *bitOutCnts,
 										global bool *blocksValuePresent,
 										global int *mtfsSymbolFrequencies,
 										global int *huffmanSymbolMaps,
 										global int *symbolMTFs,
 										global int *huffmanSelectors,
-										private const int blockCnt,
-										private const unsigned int streamBlockSize) {
+										const int blockCnt,
+										const unsigned int streamBlockSize,
+										const unsigned int bitOutBufferSize,
+										global int *huffmanCodeTables,
+										global int *blockStates) {
 				   const uint i = get_global_id(0);
-				   if (i >= blockCnt || isEmptyCompressor[i])
+				   if (i >= (uint)blockCnt)
+				   {
+					   return;
+				   }
+				   if (isEmptyCompressor[i])
 				   {
+					   bitOutCnts[i] = 0; // Takes no space in the assembled batch
 					   return;
 				   }
 
-				   close_block(blocks + i * streamBlockSize,
-							   bwtBlocks + i * streamBlockSize,
+				   // Blocks hold up to streamBlockSize bytes plus one for the BWT wraparound
+				   const uint blockStride = streamBlockSize + 1;
+				   // The MTF stage can emit one symbol more than the block length (end of block)
+				   const uint selectorStride = (streamBlockSize + HUFFMAN_GROUP_RUN_LENGTH) / HUFFMAN_GROUP_RUN_LENGTH;
+
+				   writeBlockHeader(bitOutBuffers + i * (ulong)bitOutBufferSize, &(bitOutCnts[i]), blockCRCs[i]);
+				   close_block(blocks + i * (ulong)blockStride,
+							   bwtBlocks + i * (ulong)blockStride,
 							   blockLengths[i],
 							   bucketsA + i * BUCKET_A_SIZE,
 							   bucketsB + i * BUCKET_B_SIZE,
 							   bwtTempBuffs + i * ALPHABET_SIZE,
-							   bitOutBuffers + i * 16 * streamBlockSize,
+							   bitOutBuffers + i * (ulong)bitOutBufferSize,
 							   &(bitOutCnts[i]),
 							   blocksValuePresent + i * ALPHABET_SIZE,
-							   mtfsSymbolFrequencies + i * ALPHABET_SIZE,
+							   mtfsSymbolFrequencies + i * HUFFMAN_MAXIMUM_ALPHABET_SIZE,
 							   huffmanSymbolMaps + i * ALPHABET_SIZE,
 							   symbolMTFs + i * ALPHABET_SIZE,
-							   huffmanSelectors + i * (streamBlockSize + HUFFMAN_GROUP_RUN_LENGTH - 1) / HUFFMAN_GROUP_RUN_LENGTH);
+							   huffmanSelectors + i * selectorStride,
+							   huffmanCodeTables + i * HUFFMAN_MAXIMUM_TABLES * HUFFMAN_MAXIMUM_ALPHABET_SIZE,
+							   blockStates + i * BLOCK_STATE_SIZE);
+			   }
+
+			   /* Huffman tables, the whole work-group optimises the selectors and tables of one block */
+
+			   // Same selectors and tables as HuffmanStageTables. Every pass chooses the table of each
+			   // group of symbols in parallel, counts the symbols of each table into per work item
+			   // histograms laid out bin-major (bin * histogram count + work item), reduces them and
+			   // rebuilds the tables concurrently, one per work item. Code lengths are kept in place
+			   // of the merged code symbols until the last pass.
+			   void CooperativeHuffmanTables(global int *mtfBlock,
+											 int mtfLength,
+											 int mtfAlphabetSize,
+											 global int *mtfSymbolFrequencies,
+											 global int *selectors,
+											 global int *huffmanMergedCodeSymbols,
+											 global int *histograms) {
+				   const int localId = get_local_id(0);
+				   const int localSize = get_local_size(0);
+				   const int totalTables = selectTableCount(mtfLength);
+				   const int selectorsSize = (mtfLength + HUFFMAN_GROUP_RUN_LENGTH - 1) / HUFFMAN_GROUP_RUN_LENGTH;
+				   const int binCnt = totalTables * mtfAlphabetSize;
+				   const int maxHistograms = BUCKET_B_SIZE / binCnt;
+				   const int histogramCnt = localSize < maxHistograms ? localSize : maxHistograms;
+				   global int *codeLengths = huffmanMergedCodeSymbols;
+
+				   int lowCostStarts[HUFFMAN_MAXIMUM_TABLES];
+				   int lowCostEnds[HUFFMAN_MAXIMUM_TABLES];
+				   huffmanSeedRanges(mtfLength, mtfAlphabetSize, mtfSymbolFrequencies, totalTables, lowCostStarts, lowCostEnds);
+				   for (int k = localId; k < totalTables * HUFFMAN_MAXIMUM_ALPHABET_SIZE; k += localSize)
+				   {
+					   const int table = k / HUFFMAN_MAXIMUM_ALPHABET_SIZE;
+					   const int symbol = k % HUFFMAN_MAXIMUM_ALPHABET_SIZE;
+					   const bool lowCost = symbol >= lowCostStarts[table] && symbol <= lowCostEnds[table];
+					   codeLengths[k] = (symbol < mtfAlphabetSize && !lowCost) ? HUFFMAN_HIGH_SYMBOL_COST : 0;
+				   }
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+
+				   for (int pass = 3; pass >= 0; pass--)
+				   {
+					   for (int selectorIndex = chunkStart(selectorsSize); selectorIndex < chunkEnd(selectorsSize); ++selectorIndex)
+					   {
+						   const int groupStart = selectorIndex * HUFFMAN_GROUP_RUN_LENGTH;
+						   const int groupEnd = groupStart + HUFFMAN_GROUP_RUN_LENGTH < mtfLength ? groupStart + HUFFMAN_GROUP_RUN_LENGTH : mtfLength;
+
+						   int cost[HUFFMAN_MAXIMUM_TABLES] = {0};
+						   for (int j = groupStart; j < groupEnd; j++)
+						   {
+							   const int value = mtfBlock[j];
+							   for (int table = 0; table < totalTables; table++)
+							   {
+								   cost[table] += codeLengths[table * HUFFMAN_MAXIMUM_ALPHABET_SIZE + value];
+							   }
+						   }
+
+						   int bestTable = 0;
+						   for (int table = 1; table < totalTables; table++)
+						   {
+							   if (cost[table] < cost[bestTable])
+							   {
+								   bestTable = table;
+							   }
+						   }
+						   selectors[selectorIndex] = bestTable;
+					   }
+					   for (int k = localId; k < binCnt * histogramCnt; k += localSize)
+					   {
+						   histograms[k] = 0;
+					   }
+					   barrier(CLK_GLOBAL_MEM_FENCE);
+
+					   if (localId < histogramCnt)
+					   {
+						   const int start = selectorsSize * localId / histogramCnt;
+						   const int end = selectorsSize * (localId + 1) / histogramCnt;
+						   for (int selectorIndex = start; selectorIndex < end; ++selectorIndex)
+						   {
+							   const int groupStart = selectorIndex * HUFFMAN_GROUP_RUN_LENGTH;
+							   const int groupEnd = groupStart + HUFFMAN_GROUP_RUN_LENGTH < mtfLength ? groupStart + HUFFMAN_GROUP_RUN_LENGTH : mtfLength;
+							   const int tableBins = selectors[selectorIndex] * mtfAlphabetSize;
+							   for (int j = groupStart; j < groupEnd; j++)
+							   {
+								   histograms[(tableBins + mtfBlock[j]) * histogramCnt + localId]++;
+							   }
+						   }
+					   }
+					   barrier(CLK_GLOBAL_MEM_FENCE);
+
+					   // Totals go to the first histogram
+					   for (int bin = localId; bin < binCnt; bin += localSize)
+					   {
+						   int frequency = 0;
+						   for (int h = 0; h < histogramCnt; h++)
+						   {
+							   frequency += histograms[bin * histogramCnt + h];
+						   }
+						   histograms[bin * histogramCnt] = frequency;
+					   }
+					   barrier(CLK_GLOBAL_MEM_FENCE);
+
+					   for (int table = localId; table < totalTables; table += localSize)
+					   {
+						   int tableFrequencies[HUFFMAN_MAXIMUM_ALPHABET_SIZE];
+						   int tableCodeLengths[HUFFMAN_MAXIMUM_ALPHABET_SIZE];
+						   for (int symbol = 0; symbol < mtfAlphabetSize; symbol++)
+						   {
+							   tableFrequencies[symbol] = histograms[(table * mtfAlphabetSize + symbol) * histogramCnt];
+						   }
+						   generateHuffmanCodeLengths(mtfAlphabetSize, tableFrequencies, tableCodeLengths);
+
+						   global int *tableSymbols = huffmanMergedCodeSymbols + table * HUFFMAN_MAXIMUM_ALPHABET_SIZE;
+						   if (pass == 0)
+						   {
+							   assignTableCodeSymbols(mtfAlphabetSize, tableCodeLengths, tableSymbols);
+						   }
+						   else
+						   {
+							   for (int symbol = 0; symbol < mtfAlphabetSize; symbol++)
+							   {
+								   tableSymbols[symbol] = tableCodeLengths[symbol];
+							   }
+						   }
+					   }
+					   barrier(CLK_GLOBAL_MEM_FENCE);
+				   }
+			   }
+
+			   // One work-group per block, after kernel_mtf. The histograms take the BWT bucket B
+			   // space of the block.
+			   kernel void kernel_huffman_tables(global bool *isEmptyCompressor,
+												 global int *bwtBlocks,
+												 global int *mtfsSymbolFrequencies,
+												 global int *huffmanSelectors,
+												 global int *huffmanCodeTables,
+												 global int *bucketsB,
+												 global int *blockStates,
+												 const int blockCnt,
+												 const unsigned int streamBlockSize) {
+				   const uint i = get_group_id(0);
+				   if (i >= (uint)blockCnt || isEmptyCompressor[i])
+				   {
+					   return;
+				   }
+
+				   const uint blockStride = streamBlockSize + 1;
+				   const uint selectorStride = (streamBlockSize + HUFFMAN_GROUP_RUN_LENGTH) / HUFFMAN_GROUP_RUN_LENGTH;
+				   CooperativeHuffmanTables(bwtBlocks + i * (ulong)blockStride,
+											blockStates[i * BLOCK_STATE_SIZE + BLOCK_STATE_MTF_LENGTH],
+											blockStates[i * BLOCK_STATE_SIZE + BLOCK_STATE_MTF_ALPHABET_SIZE],
+											mtfsSymbolFrequencies + i * HUFFMAN_MAXIMUM_ALPHABET_SIZE,
+											huffmanSelectors + i * selectorStride,
+											huffmanCodeTables + i * HUFFMAN_MAXIMUM_TABLES * HUFFMAN_MAXIMUM_ALPHABET_SIZE,
+											bucketsB + i * BUCKET_B_SIZE);
+			   }
+
+			   /* Huffman block data, the whole work-group emits one block */
+
+			   int mergedCodeSymbol(global int *mtfBlock, global int *selectors, global int *huffmanMergedCodeSymbols, int mtfIndex) {
+				   return huffmanMergedCodeSymbols[selectors[mtfIndex / HUFFMAN_GROUP_RUN_LENGTH] * HUFFMAN_MAXIMUM_ALPHABET_SIZE + mtfBlock[mtfIndex]];
+			   }
+
+			   // Same bits as writeBlockData after the bitCount bits already in bitBuffer. The code
+			   // lengths of each chunk are prefix summed into its bit offset, work items then write the
+			   // bytes within their chunk directly. Bytes shared with another chunk are left as
+			   // fragments (byte index, bits) and merged by the first work item.
+			   void CooperativeHuffmanEmit(global int *mtfBlock,
+										   int mtfLength,
+										   global int *selectors,
+										   global int *huffmanMergedCodeSymbols,
+										   global unsigned char *bitBuffer,
+										   global size_t *bitCount,
+										   global int *bitOffsets,
+										   global int *partials,
+										   global int *fragments) {
+				   const int localId = get_local_id(0);
+				   const int localSize = get_local_size(0);
+				   const int start = chunkStart(mtfLength);
+				   const int end = chunkEnd(mtfLength);
+				   const size_t firstBit = *bitCount;
+
+				   int chunkBits = 0;
+				   for (int j = start; j < end; ++j)
+				   {
+					   chunkBits += mergedCodeSymbol(mtfBlock, selectors, huffmanMergedCodeSymbols, j) >> 24;
+				   }
+				   bitOffsets[localId] = chunkBits;
+				   groupExclusiveScan(bitOffsets, localSize, partials);
+
+				   // Bits of the first byte before the chunk are zero, the merge fills them in
+				   const size_t chunkFirstBit = firstBit + bitOffsets[localId];
+				   const int headByte = (int)(chunkFirstBit >> 3);
+				   const bool headShared = (chunkFirstBit & 7) != 0;
+				   global int *fragment = fragments + 4 * localId;
+				   fragment[0] = -1;
+				   fragment[2] = -1;
+
+				   ulong bitAccumulator = 0;
+				   uint bitsInAccumulator = (uint)(chunkFirstBit & 7);
+				   int byteIndex = headByte;
+				   for (int j = start; j < end; ++j)
+				   {
+					   const int codeSymbol = mergedCodeSymbol(mtfBlock, selectors, huffmanMergedCodeSymbols, j);
+					   const int codeLength = codeSymbol >> 24;
+					   bitAccumulator = (bitAccumulator << codeLength) | (codeSymbol & ((1U << codeLength) - 1));
+					   bitsInAccumulator += codeLength;
+
+					   while (bitsInAccumulator >= 8)
+					   {
+						   bitsInAccumulator -= 8;
+						   const unsigned char value = (unsigned char)(bitAccumulator >> bitsInAccumulator);
+						   if (byteIndex == headByte && headShared)
+						   {
+							   fragment[0] = byteIndex;
+							   fragment[1] = value;
+						   }
+						   else
+						   {
+							   bitBuffer[byteIndex] = value;
+						   }
+						   ++byteIndex;
+					   }
+				   }
+				   if (chunkBits > 0 && bitsInAccumulator > 0)
+				   {
+					   fragment[2] = byteIndex;
+					   fragment[3] = (unsigned char)(bitAccumulator << (8 - bitsInAccumulator));
+				   }
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+
+				   // Fragments come in bit order, the first byte keeps the bits written before the block data
+				   if (localId == 0)
+				   {
+					   int mergedByte = -1;
+					   uint value = 0;
+					   for (int u = 0; u < 2 * localSize; ++u)
+					   {
+						   const int fragmentByte = fragments[2 * u];
+						   if (fragmentByte < 0)
+						   {
+							   continue;
+						   }
+						   if (fragmentByte != mergedByte)
+						   {
+							   if (mergedByte >= 0)
+							   {
+								   bitBuffer[mergedByte] = (unsigned char)value;
+							   }
+							   mergedByte = fragmentByte;
+							   value = (mergedByte == (int)(firstBit >> 3) && (firstBit & 7)) ? bitBuffer[mergedByte] : 0;
+						   }
+						   value |= fragments[2 * u + 1];
+					   }
+					   if (mergedByte >= 0)
+					   {
+						   bitBuffer[mergedByte] = (unsigned char)value;
+					   }
+				   }
+				   if (localId == localSize - 1)
+				   {
+					   *bitCount = chunkFirstBit + chunkBits;
+				   }
+			   }
+
+			   // One work-group per block, after kernel_huffman_tables. The first work item writes the
+			   // block header and tables, the whole work-group the block data after them. Scan partials
+			   // take the BWT bucket A space of the block, chunk bit offsets its temporary buffer and
+			   // the fragments the start of its bucket B space.
+			   kernel void kernel_huffman_emit(global bool *isEmptyCompressor,
+											   global int *blockCRCs,
+											   global int *bwtBlocks,
+											   global bool *blocksValuePresent,
+											   global int *huffmanSelectors,
+											   global int *huffmanCodeTables,
+											   global unsigned char *bitOutBuffers,
+											   global size_t *bitOutCnts,
+											   global int *bucketsA,
+											   global int *bucketsB,
+											   global int *bwtTempBuffs,
+											   global int *blockStates,
+											   const int blockCnt,
+											   const unsigned int streamBlockSize,
+											   const unsigned int bitOutBufferSize) {
+				   const uint i = get_group_id(0);
+				   if (i >= (uint)blockCnt)
+				   {
+					   return;
+				   }
+				   if (isEmptyCompressor[i])
+				   {
+					   if (get_local_id(0) == 0)
+					   {
+						   bitOutCnts[i] = 0; // Takes no space in the assembled batch
+					   }
+					   return;
+				   }
+
+				   const uint blockStride = streamBlockSize + 1;
+				   const uint selectorStride = (streamBlockSize + HUFFMAN_GROUP_RUN_LENGTH) / HUFFMAN_GROUP_RUN_LENGTH;
+				   global int *selectors = huffmanSelectors + i * selectorStride;
+				   global int *huffmanMergedCodeSymbols = huffmanCodeTables + i * HUFFMAN_MAXIMUM_TABLES * HUFFMAN_MAXIMUM_ALPHABET_SIZE;
+				   global int *blockState = blockStates + i * BLOCK_STATE_SIZE;
+				   global unsigned char *bitBuffer = bitOutBuffers + i * (ulong)bitOutBufferSize;
+				   if (get_local_id(0) == 0)
+				   {
+					   writeBlockHeader(bitBuffer, &(bitOutCnts[i]), blockCRCs[i]);
+
+					   struct BitWriter writer;
+					   initBitWriter(&writer, bitBuffer, bitOutCnts[i]);
+					   writeBlockTables(&writer, blocksValuePresent + i * ALPHABET_SIZE, selectors, huffmanMergedCodeSymbols, blockState);
+					   flushBitWriter(&writer, &(bitOutCnts[i]));
+				   }
+				   barrier(CLK_GLOBAL_MEM_FENCE);
+
+				   CooperativeHuffmanEmit(bwtBlocks + i * (ulong)blockStride,
+										  blockState[BLOCK_STATE_MTF_LENGTH],
+										  selectors,
+										  huffmanMergedCodeSymbols,
+										  bitBuffer,
+										  &(bitOutCnts[i]),
+										  bwtTempBuffs + i * ALPHABET_SIZE,
+										  bucketsA + i * BUCKET_A_SIZE,
+										  bucketsB + i * BUCKET_B_SIZE);
+			   }
+
+			   /* Batch assembly, the blocks of a batch are joined into one byte stream on the device */
+
+			   // Bit offset of every block in the assembled batch, after the bits carried over from
+			   // the previous batch. Batches hold few blocks, so each work item sums its predecessors
+			   // directly instead of running a multi-pass scan.
+			   kernel void kernel_block_offsets(global size_t *bitOutCnts,
+												global uint *streamCarry,
+												global uint *batchCarry,
+												global ulong *blockBitOffsets,
+												const int blockCnt) {
+				   const uint i = get_global_id(0);
+				   if (i >= (uint)blockCnt)
+				   {
+					   return;
+				   }
+
+				   ulong offset = streamCarry[1];
+				   for (uint j = 0; j <= i; ++j)
+				   {
+					   offset += bitOutCnts[j];
+				   }
+				   blockBitOffsets[i + 1] = offset;
+
+				   if (i == 0)
+				   {
+					   // kernel_assemble_blocks replaces the stream carry, it reads this copy instead
+					   blockBitOffsets[0] = streamCarry[1];
+					   batchCarry[0] = streamCarry[0];
+					   batchCarry[1] = streamCarry[1];
+				   }
+			   }
+
+			   // Gathers one output byte per work item from the carried bits and the blocks covering
+			   // it. The trailing partial byte isn't written, it becomes the carry of the next batch.
+			   kernel void kernel_assemble_blocks(global unsigned char *bitOutBuffers,
+												  global ulong *blockBitOffsets,
+												  global uint *batchCarry,
+												  global uint *streamCarry,
+												  global unsigned char *assembledBuffer,
+												  const int blockCnt,
+												  const unsigned int bitOutBufferSize) {
+				   const ulong k = get_global_id(0);
+				   const ulong totalBits = blockBitOffsets[blockCnt];
+				   const ulong begin = k << 3;
+				   if (begin >= totalBits)
+				   {
+					   return;
+				   }
+				   const ulong end = begin + 8 < totalBits ? begin + 8 : totalBits;
+
+				   uint value = 0;
+				   ulong bit = begin;
+				   int block = 0;
+				   while (bit < end)
+				   {
+					   uint bits;
+					   uint count;
+					   if (bit < blockBitOffsets[0])
+					   {
+						   // Carried bits are MSB aligned in a single byte
+						   count = (uint)((end < blockBitOffsets[0] ? end : blockBitOffsets[0]) - bit);
+						   bits = batchCarry[0] >> (8 - bit - count);
+					   }
+					   else
+					   {
+						   // Last block starting at or before bit, empty blocks share the offset of the next one
+						   int high = blockCnt - 1;
+						   while (block < high)
+						   {
+							   int middle = (block + high + 1) >> 1;
+							   if (blockBitOffsets[middle] <= bit)
+							   {
+								   block = middle;
+							   }
+							   else
+							   {
+								   high = middle - 1;
+							   }
+						   }
+
+						   const ulong blockEnd = blockBitOffsets[block + 1];
+						   const ulong blockBit = bit - blockBitOffsets[block];
+						   global unsigned char *source = bitOutBuffers + block * (ulong)bitOutBufferSize + (blockBit >> 3);
+						   const uint shift = (uint)(blockBit & 7);
+						   count = (uint)((end < blockEnd ? end : blockEnd) - bit);
+
+						   uint window = (uint)source[0] << 8;
+						   if (shift + count > 8)
+						   {
+							   window |= source[1];
+						   }
+						   bits = window >> (16 - shift - count);
+					   }
+					   value = (value << count) | (bits & ((1U << count) - 1));
+					   bit += count;
+				   }
+
+				   if (end == totalBits)
+				   {
+					   const uint carryBits = (uint)(end - begin) & 7;
+					   streamCarry[0] = carryBits ? (value << (8 - carryBits)) & 0xff : 0;
+					   streamCarry[1] = carryBits;
+					   if (carryBits)
+					   {
+						   return;
+					   }
+				   }
+				   assembledBuffer[k] = (unsigned char)value;
 			   }
 
-		   );
-} // ############################################################### end of OpenCL C code #####################################################################
\ No newline at end of file
+		   ) OPENCL_C_END // ############################################################### end of OpenCL C code #####################################################################
\ No newline at end of file
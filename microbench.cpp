@@ -0,0 +1,478 @@
+/*
+ * Copyright (c) 2024 Stanislav Brega
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <memory>
+#include <functional>
+#include <algorithm>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "include/utilities.hpp"
+#include "include/HostKernel.hpp"
+#include "include/BitOutputStream.hpp"
+#include "include/BlockCompressor.hpp"
+#include "include/BlockDecompressor.hpp"
+#include "include/BenchInput.hpp"
+
+// bzip2-microbench: runs the compression and decompression stages one at a time
+// on a single block of every input and block size, results in cycles and
+// nanoseconds per byte of the RLE1 block
+
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+static constexpr bool HAS_CYCLE_COUNTER = true;
+#else
+static constexpr bool HAS_CYCLE_COUNTER = false;
+#endif
+
+// Time stamp counter, constant rate on current x86 so these are reference cycles
+inline uint64_t readCycleCounter()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0U;
+#endif
+}
+
+// Keeps decoded values alive so the timed loops are not optimised away
+volatile int benchSink = 0;
+
+struct StageResult
+{
+    std::string input;
+    int blockSize;
+    int blockLength;
+    std::string stage;
+    double cyclesPerByte;
+    double nanosecondsPerByte;
+};
+
+struct Measurement
+{
+    uint64_t cycles;
+    double seconds;
+};
+
+// Fastest of repeatCnt runs, setup runs before each of them and is not timed
+Measurement measure(int repeatCnt, const std::function<void()> &setup, const std::function<void()> &run)
+{
+    Measurement best{UINT64_MAX, 1e300};
+    for (int i = 0; i < repeatCnt; ++i)
+    {
+        setup();
+        Clock clock;
+        const uint64_t start = readCycleCounter();
+        run();
+        const uint64_t cycles = readCycleCounter() - start;
+        const double seconds = clock.stop();
+        best.cycles = std::min(best.cycles, cycles);
+        best.seconds = std::min(best.seconds, seconds);
+    }
+    return best;
+}
+
+// The inverse BWT stages are private, they run once in the BlockDecompressor constructor
+class BlockDecompressorStages
+{
+public:
+    static void restoreBWTBlock(BlockDecompressor &decompressor, const std::vector<uint8_t> &bwtBytes)
+    {
+        decompressor.bwtBlock.assign(bwtBytes.begin(), bwtBytes.end());
+    }
+
+    static void initialiseInverseBWT(BlockDecompressor &decompressor, int bwtStartPointer)
+    {
+        decompressor.initialiseInverseBWT(bwtStartPointer);
+    }
+
+    static void rewind(BlockDecompressor &decompressor, int bwtStartPointer)
+    {
+        decompressor.bwtCurrentMergedPointer = decompressor.bwtMergedPointers[bwtStartPointer];
+        decompressor.bwtBytesDecoded = 0;
+    }
+
+    static int decodeNextBWTByte(BlockDecompressor &decompressor)
+    {
+        return decompressor.decodeNextBWTByte();
+    }
+};
+
+std::vector<char> randomInput(size_t length)
+{
+    std::vector<char> data(length);
+    uint32_t state = 54321U;
+    for (char &value : data)
+    {
+        state = state * 1103515245U + 12345U;
+        value = static_cast<char>(state >> 24);
+    }
+    return data;
+}
+
+// Runs of 1 to 32 bytes, lengths vary so no block is periodic
+std::vector<char> runsInput(size_t length)
+{
+    std::vector<char> data;
+    data.reserve(length);
+    uint32_t state = 777U;
+    while (data.size() < length)
+    {
+        state = state * 1103515245U + 12345U;
+        data.insert(data.end(), 1 + (state >> 16) % 32, static_cast<char>(state >> 8));
+    }
+    data.resize(length);
+    return data;
+}
+
+void benchBlock(const std::string &inputName, const std::vector<char> &input, int blockSize, int repeatCnt, std::vector<StageResult> &results)
+{
+    const int streamBlockSize = BLOCKSIZE_DEFAULT * blockSize;
+
+    // RLE1 and CRC as done by OutputStream, the stages below start from its block
+    std::vector<unsigned char> rleBlock(streamBlockSize + 1);
+    bool valuesPresent[ALPHABET_SIZE] = {false};
+    BlockCompressor compressor(rleBlock.data(), valuesPresent, streamBlockSize);
+    size_t consumed = 0;
+    while (consumed < input.size() && compressor.write(static_cast<unsigned char>(input[consumed])))
+    {
+        ++consumed;
+    }
+    compressor.finishRLE();
+    const int blockLength = compressor.getBlockLength();
+    if (blockLength == 0)
+    {
+        return;
+    }
+
+    auto report = [&](const char *stage, const Measurement &measurement)
+    {
+        results.push_back({inputName, blockSize, blockLength, stage,
+                           static_cast<double>(measurement.cycles) / blockLength,
+                           measurement.seconds * 1e9 / blockLength});
+    };
+    auto noSetup = [] {};
+
+    /* BWT */
+    std::vector<unsigned char> bwtInput(rleBlock);
+    bwtInput[blockLength] = bwtInput[0]; // Wrap for BWT, as close_block does
+    std::vector<int> bwtBlock(streamBlockSize + 1);
+    std::vector<int> bucketA(BWT_BUCKET_A_SIZE);
+    std::vector<int> bucketB(BWT_BUCKET_B_SIZE);
+    std::vector<int> bwtTempBuff(ALPHABET_SIZE);
+    int bwtStartPointer = 0;
+    report("bwt", measure(repeatCnt, noSetup, [&]
+                          { bwtStartPointer = host_kernel::DivSufSortBWT(bwtInput.data(), bwtBlock.data(), bucketA.data(), bucketB.data(), bwtTempBuff.data(), blockLength); }));
+
+    /* MTF + RLE2, encodes in place */
+    std::vector<int> mtfBlock(streamBlockSize + 1);
+    int mtfSymbolFrequencies[HUFFMAN_MAXIMUM_ALPHABET_SIZE];
+    int huffmanSymbolMap[ALPHABET_SIZE];
+    int symbolMTF[ALPHABET_SIZE];
+    host_kernel::MTFResult mtf{};
+    report("mtf_rle2", measure(repeatCnt, [&]
+                               { std::copy(bwtBlock.begin(), bwtBlock.end(), mtfBlock.begin()); }, [&]
+                               { mtf = host_kernel::MTFAndRLE2StageEncoder(mtfBlock.data(), blockLength, valuesPresent, mtfSymbolFrequencies, huffmanSymbolMap, symbolMTF); }));
+
+    /* Huffman */
+    int codeLengths[HUFFMAN_MAXIMUM_ALPHABET_SIZE];
+    report("huffman_code_lengths", measure(repeatCnt, noSetup, [&]
+                                           { host_kernel::generateHuffmanCodeLengths(mtf.alphabetSize, mtfSymbolFrequencies, codeLengths); }));
+
+    const int totalTables = host_kernel::selectTableCount(mtf.mtfLength);
+    const int selectorCnt = (mtf.mtfLength + HUFFMAN_GROUP_RUN_LENGTH - 1) / HUFFMAN_GROUP_RUN_LENGTH;
+    int huffmanCodeLengths[HUFFMAN_MAXIMUM_TABLES][HUFFMAN_MAXIMUM_ALPHABET_SIZE];
+    std::vector<int> selectors(selectorCnt);
+    report("huffman_selectors", measure(repeatCnt, [&]
+                                        { std::memset(huffmanCodeLengths, 0, sizeof(huffmanCodeLengths)); }, [&]
+                                        {
+                                            // Same passes as HuffmanStageTables
+                                            host_kernel::generateHuffmanOptimisationSeeds(mtf.mtfLength, mtf.alphabetSize, mtfSymbolFrequencies, huffmanCodeLengths, totalTables);
+                                            for (int i = 3; i >= 0; i--)
+                                            {
+                                                host_kernel::optimiseSelectorsAndHuffmanTables(mtfBlock.data(), mtf.mtfLength, mtf.alphabetSize, huffmanCodeLengths, totalTables, selectors.data(), i == 0);
+                                            } }));
+
+    std::vector<int> huffmanMergedCodeSymbols(HUFFMAN_MAXIMUM_TABLES * HUFFMAN_MAXIMUM_ALPHABET_SIZE);
+    host_kernel::assignHuffmanCodeSymbols(mtf.alphabetSize, huffmanCodeLengths, huffmanMergedCodeSymbols.data(), totalTables);
+
+    // Room for the longest codes plus the 32-bit words the writer flushes
+    std::vector<unsigned char> blockData(HUFFMAN_ENCODE_MAXIMUM_CODE_LENGTH * (mtf.mtfLength + 1) / 8 + 16);
+    size_t blockDataBits = 0;
+    report("block_data", measure(repeatCnt, noSetup, [&]
+                                 {
+                                     host_kernel::BitWriter writer;
+                                     host_kernel::initBitWriter(&writer, blockData.data(), 0);
+                                     host_kernel::writeBlockData(&writer, mtfBlock.data(), mtf.mtfLength, selectors.data(), huffmanMergedCodeSymbols.data());
+                                     host_kernel::flushBitWriter(&writer, &blockDataBits); }));
+
+    /* Huffman decoding of the block data written above */
+    std::vector<std::vector<uint8_t>> tableCodeLengths(HUFFMAN_MAXIMUM_TABLES, std::vector<uint8_t>(HUFFMAN_MAXIMUM_ALPHABET_SIZE));
+    for (int table = 0; table < totalTables; ++table)
+    {
+        std::copy(huffmanCodeLengths[table], huffmanCodeLengths[table] + mtf.alphabetSize, tableCodeLengths[table].begin());
+    }
+    const std::vector<uint8_t> decodeSelectors(selectors.begin(), selectors.end());
+    std::unique_ptr<BitInputStream> blockDataBitStream;
+    std::unique_ptr<HuffmanStageDecoder> huffmanDecoder;
+    std::vector<int> decodedSymbols(mtf.mtfLength);
+    report("huffman_decode", measure(repeatCnt, [&]
+                                     {
+                                         huffmanDecoder.reset();
+                                         blockDataBitStream.reset(new BitInputStream(blockData.data(), blockData.size()));
+                                         huffmanDecoder.reset(new HuffmanStageDecoder(*blockDataBitStream, mtf.alphabetSize, tableCodeLengths, decodeSelectors)); }, [&]
+                                     {
+                                         for (int i = 0; i < mtf.mtfLength; ++i)
+                                         {
+                                             decodedSymbols[i] = huffmanDecoder->nextSymbol();
+                                         } }));
+    if (!std::equal(decodedSymbols.begin(), decodedSymbols.end(), mtfBlock.begin()))
+    {
+        throw std::runtime_error("Huffman decoding differs from the encoded block");
+    }
+
+    /* MTF decoding, RUNA and RUNB carry no MTF index */
+    std::vector<int> mtfIndices;
+    for (int i = 0; i < mtf.mtfLength - 1; ++i)
+    {
+        if (mtfBlock[i] > HUFFMAN_SYMBOL_RUNB)
+        {
+            mtfIndices.push_back(mtfBlock[i] - 1);
+        }
+    }
+    MoveToFront decodeMTF;
+    report("mtf_decode", measure(repeatCnt, [&]
+                                 { decodeMTF = MoveToFront(); }, [&]
+                                 {
+                                     int sum = 0;
+                                     for (int index : mtfIndices)
+                                     {
+                                         sum += decodeMTF.indexToFront(index);
+                                     }
+                                     benchSink = sum; }));
+
+    /* Inverse BWT, on a decompressor built from the whole compressed block */
+    std::vector<unsigned char> compressedBlock(HUFFMAN_ENCODE_MAXIMUM_CODE_LENGTH * (blockLength + 1) / 8 + 16384);
+    size_t compressedBlockBits = 0;
+    writeInteger(compressedBlock.data(), &compressedBlockBits, compressor.getCRC());
+    writeBoolean(compressedBlock.data(), &compressedBlockBits, false); // Not randomised
+    {
+        std::vector<unsigned char> closeInput(rleBlock);
+        std::vector<int> closeBlock(streamBlockSize + 1);
+        std::vector<int> closeSelectors((streamBlockSize + HUFFMAN_GROUP_RUN_LENGTH) / HUFFMAN_GROUP_RUN_LENGTH);
+        std::vector<int> closeCodeTables(HUFFMAN_MAXIMUM_TABLES * HUFFMAN_MAXIMUM_ALPHABET_SIZE);
+        int closeState[BLOCK_STATE_SIZE];
+        host_kernel::close_block(closeInput.data(), closeBlock.data(), blockLength, bucketA.data(), bucketB.data(), bwtTempBuff.data(),
+                                 compressedBlock.data(), &compressedBlockBits, valuesPresent, mtfSymbolFrequencies, huffmanSymbolMap,
+                                 symbolMTF, closeSelectors.data(), closeCodeTables.data(), closeState);
+    }
+    BitInputStream compressedBitStream(compressedBlock.data(), compressedBlock.size());
+    BlockDecompressor decompressor(compressedBitStream, streamBlockSize);
+
+    std::vector<char> decompressed;
+    int decoded;
+    while ((decoded = decompressor.read()) != -1)
+    {
+        decompressed.push_back(static_cast<char>(decoded));
+    }
+    decompressor.checkCRC();
+    if (!std::equal(decompressed.begin(), decompressed.end(), input.begin()) || decompressed.size() != consumed)
+    {
+        throw std::runtime_error("Decompressed block differs from the input");
+    }
+
+    std::vector<uint8_t> bwtBytes(blockLength);
+    for (int i = 0; i < blockLength; ++i)
+    {
+        bwtBytes[i] = static_cast<uint8_t>(bwtBlock[i]);
+    }
+    report("inverse_bwt_init", measure(repeatCnt, [&]
+                                       { BlockDecompressorStages::restoreBWTBlock(decompressor, bwtBytes); }, [&]
+                                       { BlockDecompressorStages::initialiseInverseBWT(decompressor, bwtStartPointer); }));
+    report("inverse_bwt_decode", measure(repeatCnt, [&]
+                                         { BlockDecompressorStages::rewind(decompressor, bwtStartPointer); }, [&]
+                                         {
+                                             int sum = 0;
+                                             for (int i = 0; i < blockLength; ++i)
+                                             {
+                                                 sum += BlockDecompressorStages::decodeNextBWTByte(decompressor);
+                                             }
+                                             benchSink = sum; }));
+}
+
+void writeCSV(std::ostream &out, const std::vector<StageResult> &results)
+{
+    out << "input,size,block_bytes,stage,cycles_per_byte,ns_per_byte\n";
+    for (const StageResult &r : results)
+    {
+        out << r.input << ',' << r.blockSize << ',' << r.blockLength << ',' << r.stage << ',';
+        if (HAS_CYCLE_COUNTER)
+        {
+            out << r.cyclesPerByte;
+        }
+        out << ',' << r.nanosecondsPerByte << '\n';
+    }
+}
+
+void writeJSON(std::ostream &out, const std::vector<StageResult> &results)
+{
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const StageResult &r = results[i];
+        out << "  {\"input\": \"" << r.input << "\", \"size\": " << r.blockSize << ", \"block_bytes\": " << r.blockLength
+            << ", \"stage\": \"" << r.stage << "\", \"cycles_per_byte\": ";
+        if (HAS_CYCLE_COUNTER)
+        {
+            out << r.cyclesPerByte;
+        }
+        else
+        {
+            out << "null";
+        }
+        out << ", \"ns_per_byte\": " << r.nanosecondsPerByte << "}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "]\n";
+}
+
+int main(int argc, char *argv[])
+{
+    const char *flags = "\n\n  [--help|-h]              print help\n  [--size|-s <list>]       block sizes, e.g. 1-9 or 1,5,9 (default 1-9)\n  [--repeat|-r <1+>]       runs per stage, the fastest is reported (default 5)\n  [--format|-f <csv|json>] result format (default csv)\n  [--output|-o <file>]     write results to file instead of stdout\n\n  Without a file the synthetic inputs text, random and runs are used.\n  Cycles are time stamp counter cycles, left empty where there is none.\n";
+
+    std::string filename;
+    std::string outputFilename;
+    std::vector<int> blockSizes = parseList("1-9");
+    int repeatCnt = 5;
+    bool json = false;
+
+    // Parse command-line arguments
+    for (int i = 1; i < argc; ++i)
+    {
+        if ((std::strcmp(argv[i], "--size") == 0 || std::strcmp(argv[i], "-s") == 0) && i + 1 < argc)
+        {
+            blockSizes = parseList(argv[++i]);
+        }
+        else if ((std::strcmp(argv[i], "--repeat") == 0 || std::strcmp(argv[i], "-r") == 0) && i + 1 < argc)
+        {
+            repeatCnt = std::max(1, std::atoi(argv[++i]));
+        }
+        else if ((std::strcmp(argv[i], "--format") == 0 || std::strcmp(argv[i], "-f") == 0) && i + 1 < argc)
+        {
+            json = std::strcmp(argv[++i], "json") == 0;
+        }
+        else if ((std::strcmp(argv[i], "--output") == 0 || std::strcmp(argv[i], "-o") == 0) && i + 1 < argc)
+        {
+            outputFilename = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "--help") == 0 || std::strcmp(argv[i], "-h") == 0)
+        {
+            std::cout << "\n  Usage: .\\bzip2-microbench.exe [file_path] [flags]" << flags << std::endl;
+            return 0;
+        }
+        else if (argv[i][0] == '-')
+        {
+            std::cerr << "  Unknown flag!\n\n  Usage: .\\bzip2-microbench.exe [file_path] [flags]" << flags << std::endl;
+            return 1;
+        }
+        else
+        {
+            filename = argv[i];
+        }
+    }
+
+    for (int blockSize : blockSizes)
+    {
+        if (blockSize < 1 || blockSize > 9)
+        {
+            std::cerr << "Invalid block size." << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<std::pair<std::string, std::vector<char>>> inputs;
+    if (!filename.empty())
+    {
+        std::ifstream inputFile(filename, std::ios::binary);
+        if (!inputFile.is_open())
+        {
+            std::cerr << "Failed to open input file." << std::endl;
+            return 1;
+        }
+        inputs.emplace_back("file", std::vector<char>(std::istreambuf_iterator<char>(inputFile), std::istreambuf_iterator<char>()));
+    }
+    else
+    {
+        // More than a block, RLE1 shrinks runs
+        const size_t syntheticLength = 8 * MAX_BLOCK_SIZE;
+        inputs.emplace_back("text", syntheticInput(syntheticLength));
+        inputs.emplace_back("random", randomInput(syntheticLength));
+        inputs.emplace_back("runs", runsInput(syntheticLength));
+    }
+
+    std::vector<StageResult> results;
+    try
+    {
+        for (const auto &input : inputs)
+        {
+            for (int blockSize : blockSizes)
+            {
+                benchBlock(input.first, input.second, blockSize, repeatCnt, results);
+            }
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::ofstream outputFile;
+    if (!outputFilename.empty())
+    {
+        outputFile.open(outputFilename);
+        if (!outputFile.is_open())
+        {
+            std::cerr << "Failed to open output file." << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &out = outputFilename.empty() ? std::cout : outputFile;
+    if (json)
+    {
+        writeJSON(out, results);
+    }
+    else
+    {
+        writeCSV(out, results);
+    }
+    return 0;
+}